@@ -45,18 +45,30 @@ namespace driver {
 //! Enum that defines the desired output type
 /*! This enum will define the output destination. */
 typedef enum {
-  OutputTypeSoundCard, /*!< Output to hardware (the local sound card). */
-  OutputTypeFile,      /* Output to a file. */
-  OutputTypeMP3File,   /* Output to an MP3 file. */
-  OutputTypeAACFile    /* Output to an AAC file. */
+  OutputTypeSoundCard,       /*!< Output to hardware (the local sound card). */
+  OutputTypeFile,            /* Output to a file. */
+  OutputTypeMP3File,         /* Output to an MP3 file. */
+  OutputTypeAACFile,         /* Output to an AAC file. */
+  OutputTypeVirtualSoundCard /* Output to a simulated sound card running on a virtual clock. */
 } OutputType;
 
-/*! Number of samples to process at a time */
+/*! Number of samples to process at a time, by default. Sound cards may use smaller blocks. */
 #define NF_DRIVER_SAMPLE_BLOCK_SIZE 1024
 /*! The sample rate of the blocks to be sampled. In units of samples per second */
 #define NF_DRIVER_SAMPLERATE 44100
 /*! Number of channels to output a time. 2 means we're outputting stereo */
 #define NF_DRIVER_CHANNELS 2
+/*!
+ * Or'ed into the return value of a render callback if the frames are silent. The
+ * callback doesn't need to write them then, and the driver skips work on them.
+ * For example: return numberOfFrames | NF_DRIVER_SILENCE;
+ */
+#define NF_DRIVER_SILENCE 0x40000000
+/*! Whether the return value of a render callback has NF_DRIVER_SILENCE. */
+#define NF_DRIVER_IS_SILENCE(result) (((result) > 0) && ((result)&NF_DRIVER_SILENCE))
+/*! The number of frames in the return value of a render callback. */
+#define NF_DRIVER_RENDERED_FRAMES(result) \
+  (((result) > 0) ? ((result) & ~NF_DRIVER_SILENCE) : (result))
 
 /*!
  * \brief Callback called when driver stutters.
@@ -70,6 +82,43 @@ typedef void (*NF_STUTTER_CALLBACK)(void *clientdata);
  * \param clientdata Client specific data that gets used by the callback.
  */
 typedef void (*NF_WILL_RENDER_CALLBACK)(void *clientdata);
+/*!
+ * \brief Where the audio output is at, to schedule against what is actually heard.
+ *
+ * Frame counts are in the samplerate of the output device.
+ */
+typedef struct NFDriverTimestamp {
+  long long framesRendered; /*!< Frames handed to the output since playback started. */
+  long long framesPlayed;   /*!< Frames heard since playback started. */
+  double outputLatency;     /*!< Seconds until the next rendered frame is heard. */
+  double timestamp;         /*!< Seconds on the monotonic clock when this was measured. */
+  int samplerate;           /*!< The samplerate of the frame counts. */
+} NFDriverTimestamp;
+/*!
+ * \brief Callback called before rendering, with the current output timestamp.
+ *
+ * \param clientdata Client specific data that gets used by the callback.
+ * \param timestamp Where the output is at. The first frame rendered next will be heard
+ *                  at timestamp->timestamp + timestamp->outputLatency.
+ */
+typedef void (*NF_WILL_RENDER_TIMESTAMP_CALLBACK)(void *clientdata,
+                                                  const NFDriverTimestamp *timestamp);
+/*!
+ * \brief Callback receiving the captured audio, called before rendering the same period.
+ *
+ * \param clientdata Client specific data that gets used by the callback.
+ * \param frames NF_DRIVER_CHANNELS interleaved channels at the sound card's samplerate.
+ * \param numberOfFrames The number of frames captured.
+ */
+typedef void (*NF_INPUT_CALLBACK)(void *clientdata, const float *frames, int numberOfFrames);
+/*!
+ * \brief Callback called before render_callback is called at a new samplerate.
+ *
+ * \param clientdata Client specific data that gets used by the callback.
+ * \param samplerate The samplerate of the following render callbacks: the output device's
+ *                   with native_rate, NF_DRIVER_SAMPLERATE otherwise.
+ */
+typedef void (*NF_SAMPLERATE_CALLBACK)(void *clientdata, int samplerate);
 /*!
  * \brief Callback called after rendering.
  *
@@ -82,9 +131,18 @@ typedef void (*NF_DID_RENDER_CALLBACK)(void *clientdata);
  * \param clientdata Client specific data that gets used by the callback.
  * \param frames Data that will be subsequently be output to the OutputType of choice.
  * \param numberOfFrames Desired number of frames to store in frames.
- * \return Number of frames that were stored in frames.
+ * \return Number of frames that were stored in frames, with NF_DRIVER_SILENCE if silent.
  */
 typedef int (*NF_RENDER_CALLBACK)(void *clientdata, float *frames, int numberOfFrames);
+/*!
+ * \brief Callback that gathers frames to be output, one buffer per channel.
+ *
+ * \param clientdata Client specific data that gets used by the callback.
+ * \param channels NF_DRIVER_CHANNELS buffers, left then right.
+ * \param numberOfFrames Desired number of frames to store in each buffer.
+ * \return Number of frames that were stored in each buffer, with NF_DRIVER_SILENCE if silent.
+ */
+typedef int (*NF_PLANAR_RENDER_CALLBACK)(void *clientdata, float **channels, int numberOfFrames);
 /*!
  * \brief Callback called when NFDriver experiences an error.
  * \param clientdata Client specific data that gets used by the callback.
@@ -103,6 +161,93 @@ extern const char *version();
 extern const std::string NF_DRIVER_BITRATE_KEY;
 /// The key to use when specifying what size the WAV samples should be.
 extern const std::string NF_DRIVER_WAV_SIZE_KEY;
+/// The key to use when specifying a WAV file the file drivers pass to setInputCallback
+/// before every render, ending with it.
+extern const std::string NF_DRIVER_INPUT_FILE_KEY;
+/// The key to use when running the WAV and MP3 file drivers on a worker pool shared by all
+/// drivers, with a thread per CPU core ("1"), instead of a thread each.
+extern const std::string NF_DRIVER_SHARED_POOL_KEY;
+/// The key to use when specifying how many milliseconds the file drivers wait after the render
+/// callback returned no frames, doubling on every retry (1 by default, 0 retries right away).
+extern const std::string NF_DRIVER_RETRY_MIN_MS_KEY;
+/// The key to use when specifying the longest wait of the file drivers for frames (100 by
+/// default).
+extern const std::string NF_DRIVER_RETRY_MAX_MS_KEY;
+/// The key to use when enabling adaptive buffering ("1") in the sound card drivers.
+extern const std::string NF_DRIVER_ADAPTIVE_BUFFER_KEY;
+/// The key to use when specifying the minimum latency in ms the adaptive buffer may add.
+extern const std::string NF_DRIVER_MIN_LATENCY_KEY;
+/// The key to use when specifying the maximum latency in ms the adaptive buffer may add.
+extern const std::string NF_DRIVER_MAX_LATENCY_KEY;
+/// The key to use when enabling asynchronous samplerate conversion ("1") to follow the
+/// clock of the render callback's source.
+extern const std::string NF_DRIVER_ASRC_KEY;
+/// The key to use when specifying the buffer fill in ms asynchronous samplerate conversion keeps.
+extern const std::string NF_DRIVER_ASRC_TARGET_KEY;
+/// The key to use when specifying a smaller block size for the sound card drivers: 64, 128, 256
+/// or 512 frames, for lower latency.
+extern const std::string NF_DRIVER_BLOCK_SIZE_KEY;
+/// The key to use when letting the render callback render any number of frames ("1"), exactly
+/// what the sound card asks for, with the lowest latency when no resampling is needed.
+extern const std::string NF_DRIVER_DIRECT_KEY;
+/// The key to use when calling the render callback at the output device's samplerate ("1")
+/// instead of NF_DRIVER_SAMPLERATE, without resampling. Ignored with ASRC.
+extern const std::string NF_DRIVER_NATIVE_RATE_KEY;
+/// The key to use when specifying how many milliseconds a setGain change from 0 to 1 takes
+/// (10 by default).
+extern const std::string NF_DRIVER_GAIN_RAMP_KEY;
+/// The key to use when letting setPlaying(false) fade out over gain_ramp_ms and wait until the
+/// fade has played before stopping ("1"). Stopping is immediate by default.
+extern const std::string NF_DRIVER_FADE_OUT_KEY;
+/// The key to use when enabling the soft clipper on the output ("1"), bending peaks above
+/// -6 dB smoothly into full scale.
+extern const std::string NF_DRIVER_SOFT_CLIP_KEY;
+/// The key to use when enabling the peak limiter on the output, with its ceiling in dB, such
+/// as "-1".
+extern const std::string NF_DRIVER_LIMITER_CEILING_KEY;
+/// The key to use when specifying the CPUs to pin the audio thread to, such as "2,3" or "0-3".
+extern const std::string NF_DRIVER_CPU_AFFINITY_KEY;
+/// The key to use when locking and prefaulting the memory of the process ("1").
+extern const std::string NF_DRIVER_MLOCK_KEY;
+/// The key to use when specifying the audio thread's policy: "fifo", "deadline" or "other".
+extern const std::string NF_DRIVER_SCHED_POLICY_KEY;
+/// The key to use when specifying the SCHED_FIFO priority of the audio thread.
+extern const std::string NF_DRIVER_SCHED_PRIORITY_KEY;
+/// The key to use when specifying the SCHED_DEADLINE runtime in percent of the period.
+extern const std::string NF_DRIVER_SCHED_RUNTIME_KEY;
+/// The key to use when keeping the sound card open and the audio thread alive while paused ("1").
+extern const std::string NF_DRIVER_WARM_DEVICE_KEY;
+/// The key to use when specifying the period size of the sound card in frames, Linux only.
+extern const std::string NF_DRIVER_PERIOD_SIZE_KEY;
+/// The key to use when specifying the number of periods in the sound card's buffer, Linux only.
+extern const std::string NF_DRIVER_PERIOD_COUNT_KEY;
+/// The key to use when specifying how many frames are written before the sound card starts,
+/// Linux only.
+extern const std::string NF_DRIVER_START_THRESHOLD_KEY;
+/// The key to use when letting the driver measure the timing of the first seconds of playback
+/// and then keep as few periods queued as it needs ("1"), Linux only.
+extern const std::string NF_DRIVER_CALIBRATE_LATENCY_KEY;
+/// The key to use when specifying the ALSA device to capture from with setInputCallback,
+/// Linux only. The output device by default.
+extern const std::string NF_DRIVER_CAPTURE_DEVICE_KEY;
+/// The key to use when calling the stutter and error callbacks of the audio thread from a thread
+/// of normal priority a few milliseconds later ("1"), Linux only.
+extern const std::string NF_DRIVER_DEFERRED_CALLBACKS_KEY;
+/// The key to use when recording what the audio thread does for writeTrace, with how many of
+/// the last events to keep, such as "100000". Linux and the virtual sound card only.
+extern const std::string NF_DRIVER_TRACE_EVENTS_KEY;
+/// The key to use when specifying the samplerate of the virtual sound card.
+extern const std::string NF_DRIVER_VIRTUAL_SAMPLERATE_KEY;
+/// The key to use when specifying the period size in frames of the virtual sound card.
+extern const std::string NF_DRIVER_VIRTUAL_PERIOD_SIZE_KEY;
+/// The key to use when specifying the number of channels of the virtual sound card.
+extern const std::string NF_DRIVER_VIRTUAL_CHANNELS_KEY;
+/// The key to use when specifying the maximum period wakeup jitter in microseconds.
+extern const std::string NF_DRIVER_VIRTUAL_JITTER_KEY;
+/// The key to use when specifying how late in microseconds a wakeup may be before an xrun.
+extern const std::string NF_DRIVER_VIRTUAL_DEADLINE_KEY;
+/// The key to use when specifying the seed of the virtual sound card's jitter.
+extern const std::string NF_DRIVER_VIRTUAL_SEED_KEY;
 
 /*!
  * Interface used tracking state of the audio output.
@@ -122,6 +267,96 @@ class NFDriver {
    *                False if not.
    */
   virtual void setPlaying(bool playing) = 0;
+  /*!
+   * \brief Thread-safe function to check how the driver is actually running.
+   *
+   * Values that were negotiated or applied, such as the scheduling policy of the
+   * audio thread, are reported with the same keys as the options requesting them.
+   *
+   * \return A map containing properties in key value form. Empty if the driver
+   *         has nothing to report.
+   */
+  virtual std::map<std::string, std::string> getProperties() const { return {}; }
+  /*!
+   * \brief Lock-free function to get where the output is at, callable from any thread.
+   *
+   * \param timestamp Receives the latest timestamp of the output.
+   * \return False if the driver doesn't support timestamps or hasn't output anything yet.
+   */
+  virtual bool getTimestamp(NFDriverTimestamp *timestamp) const { return false; }
+  /*!
+   * \brief Sets a callback to call instead of will_render_callback, receiving the
+   *        timestamp of the output. Call it before setPlaying(true).
+   *
+   * \param callback Function called before render_callback, or nullptr to call
+   *                 will_render_callback again.
+   */
+  virtual void setWillRenderTimestampCallback(NF_WILL_RENDER_TIMESTAMP_CALLBACK callback) {}
+  /*!
+   * \brief Sets a callback to call instead of render_callback, rendering planar audio.
+   *        Call it before setPlaying(true).
+   *
+   * \param callback Function called when we have samples to output, or nullptr to
+   *                 call render_callback again.
+   * \return False if the driver doesn't support planar rendering, render_callback
+   *         is called then.
+   */
+  virtual bool setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback) { return false; }
+  /*!
+   * \brief Thread-safe function to set the output gain. Changes are ramped over
+   *        gain_ramp_ms, before the soft clipper and the limiter.
+   *
+   * \param gain The linear gain, 1 for unity.
+   * \return False if the driver doesn't support a master gain.
+   */
+  virtual bool setGain(float gain) { return false; }
+  /*!
+   * \brief Thread-safe function to set the samplerate render_callback's source actually runs
+   *        at, such as the measured rate of a network stream, with millihertz precision. The
+   *        output is resampled from it instead of NF_DRIVER_SAMPLERATE, and with asrc the
+   *        resampling ratio is trimmed around it. Ignored with native_rate.
+   *
+   * \param samplerate The source's samplerate in Hz, 0 for NF_DRIVER_SAMPLERATE.
+   * \return False if the driver doesn't support it.
+   */
+  virtual bool setSourceSamplerate(double samplerate) { return false; }
+  /*!
+   * \brief Sets a callback telling the samplerate render_callback is called at, before the
+   *        first render and on every change. Call it before setPlaying(true).
+   *
+   * \param callback Function called on the audio thread, or nullptr.
+   * \return False if the driver doesn't support it.
+   */
+  virtual bool setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback) { return false; }
+  /*!
+   * \brief Sets a callback receiving the input of the sound card, captured on the same
+   *        clock and in the same thread as the output. Call it before setPlaying(true).
+   *
+   * The file drivers pass the NF_DRIVER_INPUT_FILE_KEY file instead, a block before every
+   * render. The last block is shorter than NF_DRIVER_SAMPLE_BLOCK_SIZE frames, the driver
+   * stops rendering after it.
+   *
+   * \param callback Function called with every period captured, or nullptr for output
+   *                 only.
+   * \return False if the driver doesn't support capturing.
+   */
+  virtual bool setInputCallback(NF_INPUT_CALLBACK callback) { return false; }
+  /*!
+   * \brief Tells a file driver that the render callback has frames again, ending its
+   *        NF_DRIVER_RETRY_MIN_MS_KEY wait early. Call it from any thread.
+   *
+   * \return False if the driver doesn't wait for frames.
+   */
+  virtual bool notifyDataAvailable() { return false; }
+  /*!
+   * \brief Writes the last NF_DRIVER_TRACE_EVENTS_KEY events of the audio thread, such as
+   *        poll wakeups, renders and resampling, as Chrome trace event JSON. Call it from any
+   *        thread, also while playing.
+   *
+   * \param path The file to write, to open in chrome://tracing or Perfetto.
+   * \return False if the driver doesn't trace, tracing is off or the file couldn't be written.
+   */
+  virtual bool writeTrace(const char *path) const { return false; }
   /*! \brief Destructor */
   virtual ~NFDriver(){};
 
@@ -150,8 +385,8 @@ class NFDriver {
    * \param stutter_callback Function to call if playback stutters.
    * \param render_callback Function called when we have samples to output.
    * \param error_callback Function called when the driver errors.
-   * \param will_render_callback Function called before render_callback.
-   * \param did_render_callback Function called after render_callback.
+   * \param will_render_callback Function called before render_callback, or nullptr.
+   * \param did_render_callback Function called after render_callback, or nullptr.
    * \param outputType Desired output destination.
    * \param output_destination Name of output destination if it is a
    *                           named device, file etc.
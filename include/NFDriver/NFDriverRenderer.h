@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <NFDriver/NFDriver.h>
+
+#include <type_traits>
+#include <utility>
+
+namespace nativeformat {
+namespace driver {
+
+/*!
+ * \brief The callbacks of a renderer type, resolved at compile time.
+ *
+ * A renderer is any type with an `int render(float *frames, int numberOfFrames)`
+ * member. These are optional and only called if the type has them:
+ *
+ * - `void willRender()` or `void willRender(const NFDriverTimestamp *timestamp)`
+ * - `void didRender()`
+ * - `void stutter()`
+ * - `void error(const char *errorMessage, int errorCode)`
+ *
+ * Every callback is a function generated for the renderer type, calling the
+ * member directly, so the member can be inlined into it. A missing willRender
+ * or didRender is passed as nullptr and costs nothing per block.
+ */
+template <typename Renderer>
+class NFDriverRendererCallbacks {
+  template <typename T>
+  static auto testWillRender(int) -> decltype(std::declval<T &>().willRender(), std::true_type());
+  template <typename T>
+  static std::false_type testWillRender(...);
+  template <typename T>
+  static auto testWillRenderTimestamp(int)
+      -> decltype(std::declval<T &>().willRender(std::declval<const NFDriverTimestamp *>()),
+                  std::true_type());
+  template <typename T>
+  static std::false_type testWillRenderTimestamp(...);
+  template <typename T>
+  static auto testDidRender(int) -> decltype(std::declval<T &>().didRender(), std::true_type());
+  template <typename T>
+  static std::false_type testDidRender(...);
+  template <typename T>
+  static auto testStutter(int) -> decltype(std::declval<T &>().stutter(), std::true_type());
+  template <typename T>
+  static std::false_type testStutter(...);
+  template <typename T>
+  static auto testError(int)
+      -> decltype(std::declval<T &>().error(std::declval<const char *>(), 0), std::true_type());
+  template <typename T>
+  static std::false_type testError(...);
+
+  typedef decltype(testWillRender<Renderer>(0)) HasWillRender;
+  typedef decltype(testWillRenderTimestamp<Renderer>(0)) HasWillRenderTimestamp;
+  typedef decltype(testDidRender<Renderer>(0)) HasDidRender;
+  typedef decltype(testStutter<Renderer>(0)) HasStutter;
+  typedef decltype(testError<Renderer>(0)) HasError;
+
+  static void willRender(void *clientdata) { static_cast<Renderer *>(clientdata)->willRender(); }
+  static void willRenderTimestamp(void *clientdata, const NFDriverTimestamp *timestamp) {
+    static_cast<Renderer *>(clientdata)->willRender(timestamp);
+  }
+  static void didRender(void *clientdata) { static_cast<Renderer *>(clientdata)->didRender(); }
+  static void stutter(void *clientdata) { static_cast<Renderer *>(clientdata)->stutter(); }
+  static void noStutter(void *clientdata) {}
+  static void error(void *clientdata, const char *errorMessage, int errorCode) {
+    static_cast<Renderer *>(clientdata)->error(errorMessage, errorCode);
+  }
+  static void noError(void *clientdata, const char *errorMessage, int errorCode) {}
+
+  static NF_WILL_RENDER_CALLBACK willRenderCallback(std::true_type) { return willRender; }
+  static NF_WILL_RENDER_CALLBACK willRenderCallback(std::false_type) { return nullptr; }
+  static NF_WILL_RENDER_TIMESTAMP_CALLBACK willRenderTimestampCallback(std::true_type) {
+    return willRenderTimestamp;
+  }
+  static NF_WILL_RENDER_TIMESTAMP_CALLBACK willRenderTimestampCallback(std::false_type) {
+    return nullptr;
+  }
+  static NF_DID_RENDER_CALLBACK didRenderCallback(std::true_type) { return didRender; }
+  static NF_DID_RENDER_CALLBACK didRenderCallback(std::false_type) { return nullptr; }
+  static NF_STUTTER_CALLBACK stutterCallback(std::true_type) { return stutter; }
+  static NF_STUTTER_CALLBACK stutterCallback(std::false_type) { return noStutter; }
+  static NF_ERROR_CALLBACK errorCallback(std::true_type) { return error; }
+  static NF_ERROR_CALLBACK errorCallback(std::false_type) { return noError; }
+
+ public:
+  static int render(void *clientdata, float *frames, int numberOfFrames) {
+    return static_cast<Renderer *>(clientdata)->render(frames, numberOfFrames);
+  }
+  static NF_WILL_RENDER_CALLBACK willRenderCallback() { return willRenderCallback(HasWillRender()); }
+  static NF_WILL_RENDER_TIMESTAMP_CALLBACK willRenderTimestampCallback() {
+    return willRenderTimestampCallback(HasWillRenderTimestamp());
+  }
+  static NF_DID_RENDER_CALLBACK didRenderCallback() { return didRenderCallback(HasDidRender()); }
+  static NF_STUTTER_CALLBACK stutterCallback() { return stutterCallback(HasStutter()); }
+  static NF_ERROR_CALLBACK errorCallback() { return errorCallback(HasError()); }
+};
+
+/*!
+ * \brief Creates an NFDriver calling the members of a renderer instead of C callbacks.
+ *
+ * \param renderer The renderer, see NFDriverRendererCallbacks. Must outlive the driver.
+ * \param outputType Desired output destination.
+ * \param output_destination Name of output destination if it is a
+ *                           named device, file etc.
+ * \param options A map containing options in key value form.
+ * \return Instance of NFDriver.
+ */
+template <typename Renderer>
+NFDriver *createNFDriver(Renderer *renderer,
+                         OutputType outputType,
+                         const char *output_destination = nullptr,
+                         std::map<std::string, std::string> options = {}) {
+  typedef NFDriverRendererCallbacks<Renderer> Callbacks;
+  NFDriver *driver = NFDriver::createNFDriver(renderer,
+                                              Callbacks::stutterCallback(),
+                                              Callbacks::render,
+                                              Callbacks::errorCallback(),
+                                              Callbacks::willRenderCallback(),
+                                              Callbacks::didRenderCallback(),
+                                              outputType,
+                                              output_destination,
+                                              options);
+  if (driver && Callbacks::willRenderTimestampCallback())
+    driver->setWillRenderTimestampCallback(Callbacks::willRenderTimestampCallback());
+  return driver;
+}
+
+}  // namespace driver
+}  // namespace nativeformat
@@ -21,11 +21,14 @@
 #include <NFDriver/NFDriver.h>
 
 #include <cassert>
+#include <cmath>
+#include <sstream>
 
 #include "NFDriverAdapter.h"
 #include "NFDriverFileAACImplementation.h"
 #include "NFDriverFileImplementation.h"
 #include "NFDriverFileMP3Implementation.h"
+#include "NFDriverVirtualImplementation.h"
 #include "nfdriver_generated_header.h"
 
 namespace nativeformat {
@@ -37,6 +40,41 @@ const char *version() {
 
 extern const std::string NF_DRIVER_BITRATE_KEY = "bitrate";
 extern const std::string NF_DRIVER_WAV_SIZE_KEY = "wavsize";
+extern const std::string NF_DRIVER_INPUT_FILE_KEY = "input_file";
+extern const std::string NF_DRIVER_SHARED_POOL_KEY = "shared_pool";
+extern const std::string NF_DRIVER_RETRY_MIN_MS_KEY = "retry_min_ms";
+extern const std::string NF_DRIVER_RETRY_MAX_MS_KEY = "retry_max_ms";
+extern const std::string NF_DRIVER_ADAPTIVE_BUFFER_KEY = "adaptive_buffer";
+extern const std::string NF_DRIVER_MIN_LATENCY_KEY = "min_latency_ms";
+extern const std::string NF_DRIVER_MAX_LATENCY_KEY = "max_latency_ms";
+extern const std::string NF_DRIVER_ASRC_KEY = "asrc";
+extern const std::string NF_DRIVER_ASRC_TARGET_KEY = "asrc_target_ms";
+extern const std::string NF_DRIVER_BLOCK_SIZE_KEY = "block_size";
+extern const std::string NF_DRIVER_DIRECT_KEY = "direct";
+extern const std::string NF_DRIVER_NATIVE_RATE_KEY = "native_rate";
+extern const std::string NF_DRIVER_GAIN_RAMP_KEY = "gain_ramp_ms";
+extern const std::string NF_DRIVER_FADE_OUT_KEY = "fade_out";
+extern const std::string NF_DRIVER_SOFT_CLIP_KEY = "soft_clip";
+extern const std::string NF_DRIVER_LIMITER_CEILING_KEY = "limiter_ceiling_db";
+extern const std::string NF_DRIVER_CPU_AFFINITY_KEY = "cpu_affinity";
+extern const std::string NF_DRIVER_MLOCK_KEY = "mlockall";
+extern const std::string NF_DRIVER_SCHED_POLICY_KEY = "sched_policy";
+extern const std::string NF_DRIVER_SCHED_PRIORITY_KEY = "sched_priority";
+extern const std::string NF_DRIVER_SCHED_RUNTIME_KEY = "sched_runtime_percent";
+extern const std::string NF_DRIVER_WARM_DEVICE_KEY = "warm_device";
+extern const std::string NF_DRIVER_PERIOD_SIZE_KEY = "period_size";
+extern const std::string NF_DRIVER_PERIOD_COUNT_KEY = "period_count";
+extern const std::string NF_DRIVER_START_THRESHOLD_KEY = "start_threshold";
+extern const std::string NF_DRIVER_CALIBRATE_LATENCY_KEY = "calibrate_latency";
+extern const std::string NF_DRIVER_CAPTURE_DEVICE_KEY = "capture_device";
+extern const std::string NF_DRIVER_DEFERRED_CALLBACKS_KEY = "deferred_callbacks";
+extern const std::string NF_DRIVER_TRACE_EVENTS_KEY = "trace_events";
+extern const std::string NF_DRIVER_VIRTUAL_SAMPLERATE_KEY = "virtual_samplerate";
+extern const std::string NF_DRIVER_VIRTUAL_PERIOD_SIZE_KEY = "virtual_period_size";
+extern const std::string NF_DRIVER_VIRTUAL_CHANNELS_KEY = "virtual_channels";
+extern const std::string NF_DRIVER_VIRTUAL_JITTER_KEY = "virtual_jitter_us";
+extern const std::string NF_DRIVER_VIRTUAL_DEADLINE_KEY = "virtual_deadline_us";
+extern const std::string NF_DRIVER_VIRTUAL_SEED_KEY = "virtual_seed";
 
 int bitrateOption(const std::map<std::string, std::string> &options) {
   if (options.count(NF_DRIVER_BITRATE_KEY)) {
@@ -45,6 +83,29 @@ int bitrateOption(const std::map<std::string, std::string> &options) {
   return 128;
 }
 
+NFDriverFileSettings fileOption(const std::map<std::string, std::string> &options) {
+  NFDriverFileSettings settings;
+  if (options.count(NF_DRIVER_INPUT_FILE_KEY)) {
+    settings.inputFile = options.at(NF_DRIVER_INPUT_FILE_KEY);
+  }
+  settings.sharedPool = false;
+  if (options.count(NF_DRIVER_SHARED_POOL_KEY)) {
+    settings.sharedPool = std::stoi(options.at(NF_DRIVER_SHARED_POOL_KEY)) != 0;
+  }
+  settings.retryMinMs = 1;
+  if (options.count(NF_DRIVER_RETRY_MIN_MS_KEY)) {
+    settings.retryMinMs = std::stoi(options.at(NF_DRIVER_RETRY_MIN_MS_KEY));
+    assert(settings.retryMinMs >= 0 && "Invalid retry_min_ms option, must not be negative");
+  }
+  settings.retryMaxMs = 100;
+  if (options.count(NF_DRIVER_RETRY_MAX_MS_KEY)) {
+    settings.retryMaxMs = std::stoi(options.at(NF_DRIVER_RETRY_MAX_MS_KEY));
+    assert(settings.retryMaxMs >= settings.retryMinMs &&
+           "Invalid retry_max_ms option, must not be less than retry_min_ms");
+  }
+  return settings;
+}
+
 NFDriverFileWAVHeaderAudioFormat wavsizeOption(const std::map<std::string, std::string> &options) {
   if (options.count(NF_DRIVER_WAV_SIZE_KEY)) {
     switch (std::stoi(options.at(NF_DRIVER_WAV_SIZE_KEY))) {
@@ -59,6 +120,197 @@ NFDriverFileWAVHeaderAudioFormat wavsizeOption(const std::map<std::string, std::
   return NFDriverFileWAVHeaderAudioFormatIEEEFloat;
 }
 
+NFDriverAdapterSettings adapterOption(const std::map<std::string, std::string> &options) {
+  NFDriverAdapterSettings settings;
+  settings.adaptiveBuffering = false;
+  if (options.count(NF_DRIVER_ADAPTIVE_BUFFER_KEY)) {
+    settings.adaptiveBuffering = std::stoi(options.at(NF_DRIVER_ADAPTIVE_BUFFER_KEY)) != 0;
+  }
+  settings.minLatencyMs = 0.0f;
+  if (options.count(NF_DRIVER_MIN_LATENCY_KEY)) {
+    settings.minLatencyMs = std::stof(options.at(NF_DRIVER_MIN_LATENCY_KEY));
+  }
+  settings.maxLatencyMs = 100.0f;
+  if (options.count(NF_DRIVER_MAX_LATENCY_KEY)) {
+    settings.maxLatencyMs = std::stof(options.at(NF_DRIVER_MAX_LATENCY_KEY));
+  }
+  assert(settings.minLatencyMs >= 0.0f && settings.maxLatencyMs >= settings.minLatencyMs &&
+         "Invalid latency options");
+  settings.asrc = false;
+  if (options.count(NF_DRIVER_ASRC_KEY)) {
+    settings.asrc = std::stoi(options.at(NF_DRIVER_ASRC_KEY)) != 0;
+  }
+  settings.asrcTargetMs = 20.0f;
+  if (options.count(NF_DRIVER_ASRC_TARGET_KEY)) {
+    settings.asrcTargetMs = std::stof(options.at(NF_DRIVER_ASRC_TARGET_KEY));
+  }
+  assert(settings.asrcTargetMs > 0.0f && "Invalid ASRC target option");
+  settings.blockFrames = NF_DRIVER_SAMPLE_BLOCK_SIZE;
+  if (options.count(NF_DRIVER_BLOCK_SIZE_KEY)) {
+    settings.blockFrames = std::stoi(options.at(NF_DRIVER_BLOCK_SIZE_KEY));
+  }
+  assert(settings.blockFrames >= 64 && settings.blockFrames <= NF_DRIVER_SAMPLE_BLOCK_SIZE &&
+         (settings.blockFrames & (settings.blockFrames - 1)) == 0 && "Invalid block size option");
+  settings.direct = false;
+  if (options.count(NF_DRIVER_DIRECT_KEY)) {
+    settings.direct = std::stoi(options.at(NF_DRIVER_DIRECT_KEY)) != 0;
+  }
+  settings.nativeRate = false;
+  if (options.count(NF_DRIVER_NATIVE_RATE_KEY)) {
+    settings.nativeRate = std::stoi(options.at(NF_DRIVER_NATIVE_RATE_KEY)) != 0;
+  }
+  if (settings.asrc) settings.nativeRate = false;  // ASRC resamples.
+  settings.gainRampMs = 10.0f;
+  if (options.count(NF_DRIVER_GAIN_RAMP_KEY)) {
+    settings.gainRampMs = std::stof(options.at(NF_DRIVER_GAIN_RAMP_KEY));
+  }
+  assert(settings.gainRampMs >= 0.0f && "Invalid gain ramp option");
+  settings.fadeOut = false;
+  if (options.count(NF_DRIVER_FADE_OUT_KEY)) {
+    settings.fadeOut = std::stoi(options.at(NF_DRIVER_FADE_OUT_KEY)) != 0;
+  }
+  settings.softClip = false;
+  if (options.count(NF_DRIVER_SOFT_CLIP_KEY)) {
+    settings.softClip = std::stoi(options.at(NF_DRIVER_SOFT_CLIP_KEY)) != 0;
+  }
+  settings.limiterCeiling = 0.0f;
+  if (options.count(NF_DRIVER_LIMITER_CEILING_KEY)) {
+    float ceilingDb = std::stof(options.at(NF_DRIVER_LIMITER_CEILING_KEY));
+    assert(ceilingDb <= 0.0f && "Invalid limiter ceiling option");
+    settings.limiterCeiling = powf(10.0f, ceilingDb / 20.0f);
+  }
+  settings.traceEvents = 0;
+  if (options.count(NF_DRIVER_TRACE_EVENTS_KEY)) {
+    settings.traceEvents = std::stoi(options.at(NF_DRIVER_TRACE_EVENTS_KEY));
+  }
+  assert(settings.traceEvents >= 0 && "Invalid trace events option");
+  return settings;
+}
+
+// Parses a CPU list such as "0,2,4-7" into a mask.
+uint64_t cpuAffinityOption(const std::map<std::string, std::string> &options) {
+  uint64_t mask = 0;
+  if (options.count(NF_DRIVER_CPU_AFFINITY_KEY)) {
+    std::stringstream list(options.at(NF_DRIVER_CPU_AFFINITY_KEY));
+    std::string range;
+    while (std::getline(list, range, ',')) {
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+      assert(first >= 0 && last >= first && last < 64 && "Invalid cpu affinity option");
+      for (int cpu = first; cpu <= last; cpu++) {
+        mask |= uint64_t(1) << cpu;
+      }
+    }
+  }
+  return mask;
+}
+
+NFSoundCardSchedulingPolicy schedulingPolicyOption(
+    const std::map<std::string, std::string> &options) {
+  if (options.count(NF_DRIVER_SCHED_POLICY_KEY)) {
+    const std::string &policy = options.at(NF_DRIVER_SCHED_POLICY_KEY);
+    if (policy == "deadline") {
+      return NFSoundCardSchedulingPolicyDeadline;
+    } else if (policy == "other") {
+      return NFSoundCardSchedulingPolicyOther;
+    }
+    assert(policy == "fifo" && "Invalid scheduling policy option");
+  }
+  return NFSoundCardSchedulingPolicyFIFO;
+}
+
+NFSoundCardDriverSettings soundCardOption(const std::map<std::string, std::string> &options,
+                                          const char *output_destination) {
+  NFSoundCardDriverSettings settings;
+  settings.deviceName = output_destination ? output_destination : "";
+  settings.captureDeviceName = settings.deviceName;
+  if (options.count(NF_DRIVER_CAPTURE_DEVICE_KEY)) {
+    settings.captureDeviceName = options.at(NF_DRIVER_CAPTURE_DEVICE_KEY);
+  }
+  settings.adapter = adapterOption(options);
+  settings.cpuAffinityMask = cpuAffinityOption(options);
+  settings.schedulingPolicy = schedulingPolicyOption(options);
+  settings.schedulingPriority = 0;
+  if (options.count(NF_DRIVER_SCHED_PRIORITY_KEY)) {
+    settings.schedulingPriority = std::stoi(options.at(NF_DRIVER_SCHED_PRIORITY_KEY));
+  }
+  settings.deadlineRuntimePercent = 50;
+  if (options.count(NF_DRIVER_SCHED_RUNTIME_KEY)) {
+    settings.deadlineRuntimePercent = std::stoi(options.at(NF_DRIVER_SCHED_RUNTIME_KEY));
+  }
+  assert(settings.deadlineRuntimePercent > 0 && settings.deadlineRuntimePercent <= 100 &&
+         "Invalid scheduling runtime option");
+  settings.lockMemory = false;
+  if (options.count(NF_DRIVER_MLOCK_KEY)) {
+    settings.lockMemory = std::stoi(options.at(NF_DRIVER_MLOCK_KEY)) != 0;
+  }
+  settings.warmDevice = false;
+  if (options.count(NF_DRIVER_WARM_DEVICE_KEY)) {
+    settings.warmDevice = std::stoi(options.at(NF_DRIVER_WARM_DEVICE_KEY)) != 0;
+  }
+  settings.periodSizeFrames = settings.periodCount = settings.startThresholdFrames = 0;
+  if (options.count(NF_DRIVER_PERIOD_SIZE_KEY)) {
+    settings.periodSizeFrames = std::stoi(options.at(NF_DRIVER_PERIOD_SIZE_KEY));
+  }
+  if (options.count(NF_DRIVER_PERIOD_COUNT_KEY)) {
+    settings.periodCount = std::stoi(options.at(NF_DRIVER_PERIOD_COUNT_KEY));
+  }
+  if (options.count(NF_DRIVER_START_THRESHOLD_KEY)) {
+    settings.startThresholdFrames = std::stoi(options.at(NF_DRIVER_START_THRESHOLD_KEY));
+  }
+  assert(settings.periodSizeFrames >= 0 && settings.startThresholdFrames >= 0 &&
+         (settings.periodCount == 0 || settings.periodCount >= 2) &&
+         "Invalid period options");
+  settings.calibrateLatency = false;
+  if (options.count(NF_DRIVER_CALIBRATE_LATENCY_KEY)) {
+    settings.calibrateLatency = std::stoi(options.at(NF_DRIVER_CALIBRATE_LATENCY_KEY)) != 0;
+  }
+  settings.deferCallbacks = false;
+  if (options.count(NF_DRIVER_DEFERRED_CALLBACKS_KEY)) {
+    settings.deferCallbacks = std::stoi(options.at(NF_DRIVER_DEFERRED_CALLBACKS_KEY)) != 0;
+  }
+  return settings;
+}
+
+NFDriverVirtualDeviceSettings virtualDeviceOption(
+    const std::map<std::string, std::string> &options) {
+  NFDriverVirtualDeviceSettings settings;
+  settings.samplerate = 48000;
+  if (options.count(NF_DRIVER_VIRTUAL_SAMPLERATE_KEY)) {
+    settings.samplerate = std::stoi(options.at(NF_DRIVER_VIRTUAL_SAMPLERATE_KEY));
+  }
+  assert(settings.samplerate > 0 && "Invalid virtual samplerate option");
+  NFDriverAdapterSettings adapterSettings = adapterOption(options);
+  settings.periodSizeFrames = NFDriverAdapter::getOptimalNumberOfFrames(
+      settings.samplerate, adapterSettings.blockFrames, adapterSettings.nativeRate);
+  if (options.count(NF_DRIVER_VIRTUAL_PERIOD_SIZE_KEY)) {
+    settings.periodSizeFrames = std::stoi(options.at(NF_DRIVER_VIRTUAL_PERIOD_SIZE_KEY));
+  }
+  assert(settings.periodSizeFrames > 0 && "Invalid virtual period size option");
+  settings.numChannels = NF_DRIVER_CHANNELS;
+  if (options.count(NF_DRIVER_VIRTUAL_CHANNELS_KEY)) {
+    settings.numChannels = std::stoi(options.at(NF_DRIVER_VIRTUAL_CHANNELS_KEY));
+  }
+  assert(settings.numChannels > 0 && "Invalid virtual channels option");
+  settings.periodJitterMicroseconds = 0;
+  if (options.count(NF_DRIVER_VIRTUAL_JITTER_KEY)) {
+    settings.periodJitterMicroseconds = std::stoi(options.at(NF_DRIVER_VIRTUAL_JITTER_KEY));
+  }
+  // By default the device has two periods of buffer, like the ALSA driver, so
+  // a wakeup may be one full period late before the hardware runs dry.
+  settings.deadlineMicroseconds = static_cast<int>(
+      (static_cast<long long>(settings.periodSizeFrames) * 1000000) / settings.samplerate);
+  if (options.count(NF_DRIVER_VIRTUAL_DEADLINE_KEY)) {
+    settings.deadlineMicroseconds = std::stoi(options.at(NF_DRIVER_VIRTUAL_DEADLINE_KEY));
+  }
+  settings.seed = 1;
+  if (options.count(NF_DRIVER_VIRTUAL_SEED_KEY)) {
+    settings.seed = static_cast<unsigned int>(std::stoul(options.at(NF_DRIVER_VIRTUAL_SEED_KEY)));
+  }
+  return settings;
+}
+
 NFDriver *NFDriver::createNFDriver(void *clientdata,
                                    NF_STUTTER_CALLBACK stutter_callback,
                                    NF_RENDER_CALLBACK render_callback,
@@ -75,7 +327,8 @@ NFDriver *NFDriver::createNFDriver(void *clientdata,
                                    render_callback,
                                    error_callback,
                                    will_render_callback,
-                                   did_render_callback);
+                                   did_render_callback,
+                                   soundCardOption(options, output_destination));
     case OutputTypeFile:
       return new NFDriverFileImplementation(clientdata,
                                             stutter_callback,
@@ -84,7 +337,8 @@ NFDriver *NFDriver::createNFDriver(void *clientdata,
                                             will_render_callback,
                                             did_render_callback,
                                             output_destination,
-                                            wavsizeOption(options));
+                                            wavsizeOption(options),
+                                            fileOption(options));
     case OutputTypeMP3File:
 #if _WIN32
       assert(false && "No support for MP3 file driver on windows.");
@@ -96,7 +350,8 @@ NFDriver *NFDriver::createNFDriver(void *clientdata,
                                                will_render_callback,
                                                did_render_callback,
                                                output_destination,
-                                               bitrateOption(options));
+                                               bitrateOption(options),
+                                               fileOption(options));
 #endif
     case OutputTypeAACFile:
 #if __APPLE__
@@ -107,10 +362,22 @@ NFDriver *NFDriver::createNFDriver(void *clientdata,
                                                will_render_callback,
                                                did_render_callback,
                                                output_destination,
-                                               bitrateOption(options));
+                                               bitrateOption(options),
+                                               fileOption(options));
 #else
       assert(false && "No support for AAC file driver on this platform.");
+      break;
 #endif
+    case OutputTypeVirtualSoundCard:
+      return new NFDriverVirtualImplementation(clientdata,
+                                               stutter_callback,
+                                               render_callback,
+                                               error_callback,
+                                               will_render_callback,
+                                               did_render_callback,
+                                               output_destination,
+                                               virtualDeviceOption(options),
+                                               adapterOption(options));
   }
   return 0;
 }
@@ -20,10 +20,15 @@
  */
 #include "NFDriverAdapter.h"
 
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
+
+#include "NFDriverTrace.h"
+
 namespace nativeformat {
 namespace driver {
 
@@ -44,52 +49,157 @@ namespace driver {
 // oversampling. The noise of this resampler will typically happen around the
 // Nyquist frequency and in the -90 db or lower region. Audiophile bats may
 // complain. Humans are not able to notice.
+//
+// The position between two input frames is an integer phase, in units of
+// 1 / den. Every output frame adds step to it, so the ratio step / den is
+// exact, such as 147 / 160 for 48000 Hz, and the frame counts never drift.
+// Rates the ratio can't be reduced for, such as with ASRC, are 32.32 fixed
+// point.
+#define RESAMPLER_FIXED_POINT_ONE (uint64_t(1) << 32)
+// Up to this many phases the interpolation weights come from a table.
+#define RESAMPLER_MAX_TABLE_PHASES 2048
+
 typedef struct resamplerData {
-  uint64_t *input;  // A buffer on the heap to store NF_DRIVER_SAMPLE_BLOCK_SIZE audio.
+  uint64_t *input;  // A buffer on the heap to store NF_DRIVER_SAMPLE_BLOCK_SIZE audio,
+                    // the largest block size.
   union {
     float f[2];
     uint64_t i;  // Makes loads faster a bit. Don't believe the hype, compilers
                  // are still quite dumb.
   } prev;
-  float rate, slopeCount;
+  uint64_t phase, step, den;
+  float *weights;       // Per phase, or NULL to compute them with invDen.
+  float *weightsTable;  // A buffer on the heap for RESAMPLER_MAX_TABLE_PHASES weights.
+  double invDen;
 } resamplerData;
 
+static uint64_t greatestCommonDivisor(uint64_t a, uint64_t b) {
+  while (b) {
+    uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+// Sets the ratio step / den of input frames per output frame, keeping the
+// position. The phase and the weights only change with den.
+static void setResamplingStep(resamplerData *resampler, uint64_t step, uint64_t den) {
+  resampler->step = step;
+  if (den == resampler->den) return;
+
+  if (resampler->den) resampler->phase = resampler->phase * den / resampler->den;
+  resampler->den = den;
+  resampler->invDen = 1.0 / static_cast<double>(den);
+  if ((den <= RESAMPLER_MAX_TABLE_PHASES) && resampler->weightsTable) {
+    for (uint64_t phase = 0; phase < den; phase++)
+      resampler->weightsTable[phase] = static_cast<float>(static_cast<double>(phase) / den);
+    resampler->weights = resampler->weightsTable;
+  } else
+    resampler->weights = NULL;
+}
+
+// Sets the ratio of input frames per output frame, with as few phases as it
+// can be reduced to.
+static void setResamplingRatio(resamplerData *resampler, uint64_t inputRate, uint64_t outputRate) {
+  uint64_t divisor = greatestCommonDivisor(inputRate, outputRate);
+  uint64_t step = inputRate / divisor, den = outputRate / divisor;
+  if (den > RESAMPLER_FIXED_POINT_ONE) {  // Too fine, the phase math would overflow.
+    step = static_cast<uint64_t>(static_cast<double>(inputRate) / static_cast<double>(outputRate) *
+                                     static_cast<double>(RESAMPLER_FIXED_POINT_ONE) +
+                                 0.5);
+    den = RESAMPLER_FIXED_POINT_ONE;
+  }
+  setResamplingStep(resampler, step, den);
+}
+
+static inline float phaseWeight(const resamplerData *resampler, uint64_t phase) {
+  return resampler->weights
+             ? resampler->weights[phase]
+             : static_cast<float>(static_cast<double>(phase) * resampler->invDen);
+}
+
 // This linear resampler is not "Superpowered", but still faster than most naive
 // implementations.
 static int resample(float *output, resamplerData *resampler, int numFrames) {
   resamplerData stack = *resampler;  // Local copy on the stack, preventing the
                                      // compiler writing back intermediate
                                      // results to memory.
-  float left, right, invSlopeCount;
+  decltype(stack.prev) next;
+  float left, right, slope, invSlope;
   int outFrames = 0;
 
   while (true) {
-    while (stack.slopeCount > 1.0f) {
+    while (stack.phase >= stack.den) {
       numFrames--;
-      stack.slopeCount -= 1.0f;
+      stack.phase -= stack.den;
 
       if (!numFrames) {  // Quit resampling, writing back the intermediate
-                         // results to memory.
-        resampler->slopeCount = stack.slopeCount;
-        resampler->prev.i = stack.prev.i;
+                         // results to memory. The last input frame is the
+                         // previous one of the next block.
+        resampler->phase = stack.phase;
+        resampler->prev.i = *stack.input;
         return outFrames;
       }
 
       stack.prev.i = *stack.input++;
     }
 
-    // Linear resampling, the compiler may recognize that these are primitive
-    // Assembly instructions.
-    invSlopeCount = 1.0f - stack.slopeCount;
-    left = invSlopeCount * stack.prev.f[0];
-    right = invSlopeCount * stack.prev.f[1];
+    // Linear resampling between the previous and the next input frame, the
+    // compiler may recognize that these are primitive Assembly instructions.
+    // Upsampling outputs more frames between the same two.
+    slope = phaseWeight(&stack, stack.phase);
+    invSlope = 1.0f - slope;
+    left = invSlope * stack.prev.f[0];
+    right = invSlope * stack.prev.f[1];
+
+    next.i = *stack.input;
+
+    *output++ = left + slope * next.f[0];
+    *output++ = right + slope * next.f[1];
+
+    stack.phase += stack.step;
+    outFrames++;
+  }
+}
+
+// The same for planar audio. The input holds NF_DRIVER_SAMPLE_BLOCK_SIZE left
+// samples, then as many right samples.
+static int resamplePlanar(float *outputLeft,
+                          float *outputRight,
+                          resamplerData *resampler,
+                          int numFrames) {
+  resamplerData stack = *resampler;
+  const float *inputLeft = reinterpret_cast<float *>(stack.input),
+              *inputRight = inputLeft + NF_DRIVER_SAMPLE_BLOCK_SIZE;
+  float left, right, slope, invSlope;
+  int outFrames = 0;
+
+  while (true) {
+    while (stack.phase >= stack.den) {
+      numFrames--;
+      stack.phase -= stack.den;
+
+      if (!numFrames) {
+        resampler->phase = stack.phase;
+        resampler->prev.f[0] = *inputLeft;
+        resampler->prev.f[1] = *inputRight;
+        return outFrames;
+      }
+
+      stack.prev.f[0] = *inputLeft++;
+      stack.prev.f[1] = *inputRight++;
+    }
 
-    stack.prev.i = *stack.input;
+    slope = phaseWeight(&stack, stack.phase);
+    invSlope = 1.0f - slope;
+    left = invSlope * stack.prev.f[0];
+    right = invSlope * stack.prev.f[1];
 
-    *output++ = left + stack.slopeCount * stack.prev.f[0];
-    *output++ = right + stack.slopeCount * stack.prev.f[1];
+    *outputLeft++ = left + slope * *inputLeft;
+    *outputRight++ = right + slope * *inputRight;
 
-    stack.slopeCount += stack.rate;
+    stack.phase += stack.step;
     outFrames++;
   }
 }
@@ -131,32 +241,450 @@ static void makeOutput(
   }
 }
 
+// The same from planar audio. Only interleaved outputs need any work beyond a
+// copy.
+static void makePlanarOutput(const float *inputLeft,
+                             const float *inputRight,
+                             float **outputLeft,
+                             float **outputRight,
+                             int numFrames,
+                             int numChannels) {
+  if (numChannels == 1) {  // Mono output.
+    float *mono = *outputLeft;
+    *outputLeft += numFrames;
+
+    while (numFrames--) *mono++ = (*inputLeft++ + *inputRight++) * 0.5f;
+  } else if (*outputRight) {  // Stereo non-interleaved output.
+    memcpy(*outputLeft, inputLeft, static_cast<size_t>(numFrames) * sizeof(float));
+    memcpy(*outputRight, inputRight, static_cast<size_t>(numFrames) * sizeof(float));
+    *outputLeft += numFrames;
+    *outputRight += numFrames;
+  } else {  // Interleaved output, the channels after the first 2 are silent.
+    float *output = *outputLeft;
+    *outputLeft += numFrames * numChannels;
+    if (numChannels > 2)
+      memset(output, 0, static_cast<size_t>(numFrames * numChannels) * sizeof(float));
+
+    while (numFrames--) {
+      output[0] = *inputLeft++;
+      output[1] = *inputRight++;
+      output += numChannels;
+    }
+  }
+}
+
+// Master stage stuff.
+// The soft clipper is linear up to the knee, then bends into full scale with
+// the cubic t - 4/27 t^3, which reaches 1 with zero slope at t = 1.5.
+#define SOFT_CLIP_KNEE 0.5f
+// The limiter has no lookahead. It works in chunks: instant attack to the
+// chunk's peak, then a linear release, so no sample exceeds the ceiling.
+#define LIMITER_CHUNK_FRAMES 32
+#define LIMITER_RELEASE_SECONDS 0.05
+
+typedef struct masterStageData {
+  float gain, targetGain, maxGainStepPerFrame;
+  float limiterGain, limiterCeiling, limiterReleasePerChunk;  // No limiter if the
+                                                               // ceiling is zero.
+  float gainRampMs;
+  bool softClip;
+} masterStageData;
+
+// The loops below are plain, so the compiler can vectorize them. Stride is 2
+// for interleaved and 1 for planar audio.
+template <int stride>
+static void applyGain(float *left, float *right, int numFrames, float gain, float step) {
+  for (int n = 0; n < numFrames; n++) {
+    left[n * stride] *= gain;
+    right[n * stride] *= gain;
+    gain += step;
+  }
+}
+
+static void softClip(float *samples, int numSamples) {
+  const float scale = 1.0f / (1.0f - SOFT_CLIP_KNEE);
+  for (int n = 0; n < numSamples; n++) {
+    float x = samples[n], a = fabsf(x), t = (a - SOFT_CLIP_KNEE) * scale;
+    t = t < 0.0f ? 0.0f : (t > 1.5f ? 1.5f : t);
+    float y = (a < SOFT_CLIP_KNEE ? a : SOFT_CLIP_KNEE) +
+              (1.0f - SOFT_CLIP_KNEE) * (t - (4.0f / 27.0f) * t * t * t);
+    samples[n] = copysignf(y, x);
+  }
+}
+
+template <int stride>
+static void limit(masterStageData *stage, float *left, float *right, int numFrames) {
+  for (int start = 0; start < numFrames; start += LIMITER_CHUNK_FRAMES) {
+    int chunkFrames = numFrames - start;
+    if (chunkFrames > LIMITER_CHUNK_FRAMES) chunkFrames = LIMITER_CHUNK_FRAMES;
+    float *chunkLeft = left + start * stride, *chunkRight = right + start * stride;
+
+    float peak = 0.0f;
+    for (int n = 0; n < chunkFrames; n++) {
+      float l = fabsf(chunkLeft[n * stride]), r = fabsf(chunkRight[n * stride]);
+      float m = l > r ? l : r;
+      peak = m > peak ? m : peak;
+    }
+
+    float target = (peak > stage->limiterCeiling) ? stage->limiterCeiling / peak : 1.0f;
+    float gain = stage->limiterGain, step = 0.0f;
+    if (target < gain)
+      gain = target;
+    else {  // Releasing, but never above the target in this chunk.
+      float next = gain + stage->limiterReleasePerChunk;
+      if (next > target) next = target;
+      step = (next - gain) / static_cast<float>(chunkFrames);
+    }
+    if ((gain < 1.0f) || (step != 0.0f))
+      applyGain<stride>(chunkLeft, chunkRight, chunkFrames, gain, step);
+    stage->limiterGain = gain + step * static_cast<float>(chunkFrames);
+  }
+}
+
+static bool isMasterStageActive(const masterStageData *stage) {
+  return stage->softClip || (stage->limiterCeiling > 0.0f) || (stage->gain != 1.0f) ||
+         (stage->targetGain != 1.0f);
+}
+
+// Gain ramp, soft clipper and limiter, in place.
+template <int stride>
+static void processMasterStage(masterStageData *stage, float *left, float *right, int numFrames) {
+  float gain = stage->gain, step = 0.0f;
+  if (stage->gain != stage->targetGain) {
+    float distance = stage->targetGain - stage->gain,
+          maxDistance = stage->maxGainStepPerFrame * static_cast<float>(numFrames);
+    if (fabsf(distance) > maxDistance) {
+      distance = copysignf(maxDistance, distance);
+      stage->gain += distance;
+    } else
+      stage->gain = stage->targetGain;
+    step = distance / static_cast<float>(numFrames);
+  }
+  if ((gain != 1.0f) || (step != 0.0f)) applyGain<stride>(left, right, numFrames, gain, step);
+
+  if (stage->softClip) {
+    if (stride == 2)
+      softClip(left, numFrames * 2);
+    else {
+      softClip(left, numFrames);
+      softClip(right, numFrames);
+    }
+  }
+
+  if (stage->limiterCeiling > 0.0f) limit<stride>(stage, left, right, numFrames);
+}
+
+// Adaptive buffering stuff.
+// The statistics are exponential moving averages. With 1/64 they follow a
+// change in the jitter within a second, but a single late callback will not
+// blow the buffer up.
+#define ADAPTIVE_SMOOTHING (1.0 / 64.0)
+// How many standard deviations of jitter the prebuffer should cover.
+#define ADAPTIVE_HEADROOM 3.0
+// The prebuffer grows immediately, but shrinks at most 1/256 of the distance
+// per callback, so it doesn't oscillate with bursty loads.
+#define ADAPTIVE_SHRINK_DIVIDER 256
+
+// Asynchronous samplerate conversion stuff.
+// The controller works on the fill error in seconds. The fill is the integral
+// of the ratio error, so KI = KP * KP / 4 gives a critically damped loop,
+// settling in about a minute without audible pitch modulation.
+#define ASRC_KP 0.05
+#define ASRC_KI (ASRC_KP * ASRC_KP / 4.0)
+// Real clocks drift within a few hundred ppm, more is a broken source.
+#define ASRC_MAX_CORRECTION 0.001
+
+// setSamplerate and setFractionalSamplerate pass the rate in millihertz.
+#define SAMPLERATE_SCALE 1000
+
+static double monotonicSeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 // Finally, the adapter implementation starts here.
 typedef struct NFDriverAdapterInternals {
   resamplerData resampler;
   void *clientdata;
   NF_WILL_RENDER_CALLBACK willRenderCallback;
   NF_RENDER_CALLBACK renderCallback;
+  NF_PLANAR_RENDER_CALLBACK planarRenderCallback;
+  NF_SAMPLERATE_CALLBACK samplerateCallback;
   NF_DID_RENDER_CALLBACK didRenderCallback;
   NF_STUTTER_CALLBACK stutterCallback;
-  float *interleavedBuffer;
+  void *stutterClientdata;
+  float *interleavedBuffer;  // Two planes with a planar render callback, the
+                             // right one starting at bufferCapacityFrames.
   int bufferCapacityFrames, framesInBuffer, readPositionFrames, writePositionFrames,
       bufferCapacityToEndNeeded;
-  ATOMIC_SIGNED_INT nextSamplerate;
-  bool needsResampling;
+  ATOMIC_SIGNED_INT nextSamplerate, nextSourceSamplerate;  // In millihertz.
+  int blockFrames;                   // Frames per render callback.
+  int silentFramesAtEnd;             // The last frames in our buffer known to be silent.
+  masterStageData master;
+  bool needsResampling, previousBlockSilent;
+
+  // Adaptive buffering.
+  double lastCallbackTime, periodJitterVariance, renderTimeMean, renderTimeVariance;
+  float minLatencyMs, maxLatencyMs;
+  int samplerate, lastNumFrames, targetFrames, minTargetFrames, maxTargetFrames;
+  bool adaptiveBuffering;
+
+  // Asynchronous samplerate conversion.
+  double nominalRate, asrcFill, asrcIntegral, asrcCorrection;
+  uint64_t sourceMillihertz, outputMillihertz;
+  float asrcTargetMs;
+  int asrcTargetFrames;
+  bool asrc;
+
+  bool direct;
+
+  bool nativeRate;
+  int renderSamplerate;  // What the render callback runs at, zero before the first.
 } NFDriverAdapterInternals;
 
+// Outputs numFrames from our buffer, starting at positionFrames.
+static void makeOutputFromBuffer(NFDriverAdapterInternals *internals,
+                                 int positionFrames,
+                                 float **outputLeft,
+                                 float **outputRight,
+                                 int numFrames,
+                                 int numChannels) {
+  NFDriverTrace::begin("makeOutput");
+  if (internals->planarRenderCallback) {
+    float *left = internals->interleavedBuffer + positionFrames;
+    if (isMasterStageActive(&internals->master))
+      processMasterStage<1>(
+          &internals->master, left, left + internals->bufferCapacityFrames, numFrames);
+    makePlanarOutput(left,
+                     left + internals->bufferCapacityFrames,
+                     outputLeft,
+                     outputRight,
+                     numFrames,
+                     numChannels);
+  } else {
+    float *input = internals->interleavedBuffer + positionFrames * 2;
+    if (isMasterStageActive(&internals->master))
+      processMasterStage<2>(&internals->master, input, input + 1, numFrames);
+    makeOutput(input, outputLeft, outputRight, numFrames, numChannels);
+  }
+  NFDriverTrace::end("makeOutput");
+}
+
+// Calls the planar or the interleaved render callback, returning with its
+// result. Right is only used by the planar one.
+static int callRenderCallback(NFDriverAdapterInternals *internals,
+                              float *left,
+                              float *right,
+                              int numFrames) {
+  NFDriverTrace::begin("render");
+  int result;
+  if (internals->planarRenderCallback) {
+    float *channels[2] = {left, right};
+    result = internals->planarRenderCallback(internals->clientdata, channels, numFrames);
+  } else
+    result = internals->renderCallback(internals->clientdata, left, numFrames);
+  NFDriverTrace::end("render");
+  return result;
+}
+
+static void callDidRenderCallback(NFDriverAdapterInternals *internals) {
+  if (!internals->didRenderCallback) return;
+  NFDriverTrace::begin("did_render");
+  internals->didRenderCallback(internals->clientdata);
+  NFDriverTrace::end("did_render");
+}
+
+// Zeroes frames the render callback returned as silence without writing them.
+static void clearFrames(NFDriverAdapterInternals *internals,
+                        float *left,
+                        float *right,
+                        int numFrames) {
+  if (internals->planarRenderCallback) {
+    memset(left, 0, static_cast<size_t>(numFrames) * sizeof(float));
+    memset(right, 0, static_cast<size_t>(numFrames) * sizeof(float));
+  } else
+    memset(left, 0, static_cast<size_t>(numFrames) * sizeof(float) * 2);
+}
+
+// Direct mode with nothing buffered and a matching format: the render callback
+// renders into the output of the audio I/O.
+static bool canRenderDirectly(NFDriverAdapterInternals *internals,
+                              float *outputRight,
+                              int numChannels) {
+  return (internals->framesInBuffer == 0) && (numChannels == 2) &&
+         ((outputRight != NULL) == (internals->planarRenderCallback != NULL));
+}
+
+// Returns with the number of frames rendered, less than numFrames if the
+// source ran short. Only a whole silent period is left unwritten.
+static int renderDirectly(NFDriverAdapterInternals *internals,
+                          float *outputLeft,
+                          float *outputRight,
+                          int numFrames,
+                          bool *silent) {
+  int result = callRenderCallback(internals, outputLeft, outputRight, numFrames);
+  int framesRendered = NF_DRIVER_RENDERED_FRAMES(result);
+  if (framesRendered <= 0) return 0;
+  if (framesRendered > numFrames) framesRendered = numFrames;
+  if (!NF_DRIVER_IS_SILENCE(result)) {
+    if (!isMasterStageActive(&internals->master))
+      ;
+    else if (internals->planarRenderCallback)
+      processMasterStage<1>(&internals->master, outputLeft, outputRight, framesRendered);
+    else
+      processMasterStage<2>(&internals->master, outputLeft, outputLeft + 1, framesRendered);
+  } else if (silent && (framesRendered == numFrames))
+    *silent = true;
+  else
+    clearFrames(internals, outputLeft, outputRight, framesRendered);
+  return framesRendered;
+}
+
+// Measures the deviation of the audio I/O's callback timing from the nominal
+// period.
+static void trackPeriodJitter(NFDriverAdapterInternals *internals,
+                              double callbackTime,
+                              int numFrames) {
+  if ((internals->lastCallbackTime >= 0.0) && (internals->samplerate > 0)) {
+    double error = (callbackTime - internals->lastCallbackTime) -
+                   static_cast<double>(internals->lastNumFrames) / internals->samplerate;
+    internals->periodJitterVariance +=
+        (error * error - internals->periodJitterVariance) * ADAPTIVE_SMOOTHING;
+  }
+  internals->lastCallbackTime = callbackTime;
+  internals->lastNumFrames = numFrames;
+}
+
+static void trackRenderTime(NFDriverAdapterInternals *internals, double renderTime) {
+  double delta = renderTime - internals->renderTimeMean;
+  internals->renderTimeMean += delta * ADAPTIVE_SMOOTHING;
+  internals->renderTimeVariance +=
+      (delta * delta - internals->renderTimeVariance) * ADAPTIVE_SMOOTHING;
+}
+
+// The ratio is exact without ASRC. With ASRC it's 32.32 fixed point from the
+// start, so a trim only changes the step, never the phase or the weights.
+static void updateResamplingRatio(NFDriverAdapterInternals *internals) {
+  if (!internals->asrc) {
+    setResamplingRatio(
+        &internals->resampler, internals->sourceMillihertz, internals->outputMillihertz);
+    return;
+  }
+  uint64_t step = static_cast<uint64_t>(internals->nominalRate * (1.0 + internals->asrcCorrection) *
+                                            static_cast<double>(RESAMPLER_FIXED_POINT_ONE) +
+                                        0.5);
+  if ((step != internals->resampler.step) ||
+      (internals->resampler.den != RESAMPLER_FIXED_POINT_ONE))
+    setResamplingStep(&internals->resampler, step, RESAMPLER_FIXED_POINT_ONE);
+}
+
+// Follows a change of the output's or the source's samplerate.
+static void updateResampling(NFDriverAdapterInternals *internals) {
+  internals->needsResampling =
+      internals->asrc ||
+      (!internals->nativeRate && (internals->outputMillihertz != internals->sourceMillihertz));
+  internals->nominalRate = static_cast<double>(internals->sourceMillihertz) /
+                           static_cast<double>(internals->outputMillihertz);
+  updateResamplingRatio(internals);
+  // With ASRC the resampler may produce slightly more frames than nominal.
+  internals->bufferCapacityToEndNeeded =
+      internals->needsResampling
+          ? static_cast<int>((1.0 + ASRC_MAX_CORRECTION) * (internals->blockFrames + 2) /
+                             internals->nominalRate)
+          : internals->blockFrames;
+}
+
+// A PI controller keeps the fill of our buffer at the setpoint by trimming the
+// resampling ratio. The fill is measured after the output consumed its frames,
+// and smoothed, as it moves in block sized steps as the source delivers.
+static void trimResamplingRatio(NFDriverAdapterInternals *internals,
+                                int numFrames,
+                                bool sourceRanOut) {
+  if (internals->samplerate <= 0) return;
+  double samplerate = static_cast<double>(internals->samplerate);
+  internals->asrcFill += (internals->framesInBuffer - internals->asrcFill) * ADAPTIVE_SMOOTHING;
+  // If the source had everything we pulled, such as a file or a source with a
+  // backlog, the fill is at the ceiling and tells nothing about its clock.
+  // Hold the ratio then, instead of running away to the maximum correction.
+  if (!sourceRanOut) return;
+  double errorSeconds = (internals->asrcFill - internals->asrcTargetFrames) / samplerate;
+
+  // Anti-windup: the integral stops growing while the correction is saturated.
+  double proportional = ASRC_KP * errorSeconds;
+  double integral = internals->asrcIntegral + ASRC_KI * errorSeconds * (numFrames / samplerate);
+  double correction = proportional + integral;
+  if (correction > ASRC_MAX_CORRECTION) {
+    correction = ASRC_MAX_CORRECTION;
+    if (integral > internals->asrcIntegral) integral = internals->asrcIntegral;
+  } else if (correction < -ASRC_MAX_CORRECTION) {
+    correction = -ASRC_MAX_CORRECTION;
+    if (integral < internals->asrcIntegral) integral = internals->asrcIntegral;
+  }
+  if (integral > ASRC_MAX_CORRECTION) integral = ASRC_MAX_CORRECTION;
+  if (integral < -ASRC_MAX_CORRECTION) integral = -ASRC_MAX_CORRECTION;
+  internals->asrcIntegral = integral;
+
+  // More audio than the setpoint: consume the source faster.
+  internals->asrcCorrection = correction;
+  updateResamplingRatio(internals);
+}
+
+// Moves the prebuffer target towards what the measured jitter needs, or one
+// block up if we just stuttered.
+static void updateTargetFrames(NFDriverAdapterInternals *internals, bool success) {
+  double headroomSeconds = ADAPTIVE_HEADROOM * (sqrt(internals->periodJitterVariance) +
+                                                sqrt(internals->renderTimeVariance));
+  int desiredFrames = static_cast<int>(headroomSeconds * internals->samplerate);
+  if (!success) desiredFrames = internals->targetFrames + internals->blockFrames;
+
+  if (desiredFrames > internals->targetFrames)
+    internals->targetFrames = desiredFrames;
+  else
+    internals->targetFrames -= (internals->targetFrames - desiredFrames +
+                                ADAPTIVE_SHRINK_DIVIDER - 1) /
+                               ADAPTIVE_SHRINK_DIVIDER;
+
+  if (internals->targetFrames > internals->maxTargetFrames)
+    internals->targetFrames = internals->maxTargetFrames;
+  if (internals->targetFrames < internals->minTargetFrames)
+    internals->targetFrames = internals->minTargetFrames;
+}
+
 NFDriverAdapter::NFDriverAdapter(void *clientdata,
                                  NF_STUTTER_CALLBACK stutter_callback,
                                  NF_RENDER_CALLBACK render_callback,
                                  NF_ERROR_CALLBACK error_callback,
                                  NF_WILL_RENDER_CALLBACK will_render_callback,
-                                 NF_DID_RENDER_CALLBACK did_render_callback) {
+                                 NF_DID_RENDER_CALLBACK did_render_callback,
+                                 const NFDriverAdapterSettings *settings) {
   internals = new NFDriverAdapterInternals;
   memset(internals, 0, sizeof(NFDriverAdapterInternals));
+  internals->lastCallbackTime = -1.0;
+  internals->blockFrames = NF_DRIVER_SAMPLE_BLOCK_SIZE;
+  internals->master.gain = internals->master.targetGain = internals->master.limiterGain = 1.0f;
+  internals->master.gainRampMs = 10.0f;
+  internals->sourceMillihertz = static_cast<uint64_t>(NF_DRIVER_SAMPLERATE) * SAMPLERATE_SCALE;
+
+  if (settings) {
+    internals->adaptiveBuffering = settings->adaptiveBuffering;
+    internals->minLatencyMs = settings->minLatencyMs;
+    internals->maxLatencyMs = settings->maxLatencyMs;
+    if (internals->maxLatencyMs < internals->minLatencyMs)
+      internals->maxLatencyMs = internals->minLatencyMs;
+    internals->asrc = settings->asrc;
+    internals->asrcTargetMs = settings->asrcTargetMs;
+    internals->direct = settings->direct;
+    internals->nativeRate = settings->nativeRate && !settings->asrc;  // ASRC resamples.
+    internals->master.gainRampMs = settings->gainRampMs;
+    internals->master.softClip = settings->softClip;
+    internals->master.limiterCeiling = settings->limiterCeiling;
+    if ((settings->blockFrames > 0) && (settings->blockFrames < NF_DRIVER_SAMPLE_BLOCK_SIZE))
+      internals->blockFrames = settings->blockFrames;
+  }
 
   internals->clientdata = clientdata;
   internals->stutterCallback = stutter_callback;
+  internals->stutterClientdata = clientdata;
   internals->renderCallback = render_callback;
   internals->willRenderCallback = will_render_callback;
   internals->didRenderCallback = did_render_callback;
@@ -172,13 +700,16 @@ NFDriverAdapter::NFDriverAdapter(void *clientdata,
 
   internals->resampler.input =
       reinterpret_cast<uint64_t *>(malloc(NF_DRIVER_SAMPLE_BLOCK_SIZE * sizeof(uint64_t)));
-  if (!internals->resampler.input)
+  internals->resampler.weightsTable =
+      reinterpret_cast<float *>(malloc(RESAMPLER_MAX_TABLE_PHASES * sizeof(float)));
+  if (!internals->resampler.input || !internals->resampler.weightsTable)
     error_callback(clientdata, "Out of memory in NFDriverAdapter.", 0);
 }
 
 NFDriverAdapter::~NFDriverAdapter() {
   if (internals->interleavedBuffer) free(internals->interleavedBuffer);
   if (internals->resampler.input) free(internals->resampler.input);
+  if (internals->resampler.weightsTable) free(internals->resampler.weightsTable);
   delete internals;
 }
 
@@ -186,31 +717,113 @@ NFDriverAdapter::~NFDriverAdapter() {
 bool NFDriverAdapter::getFrames(float *outputLeft,
                                 float *outputRight,
                                 int numFrames,
-                                int numChannels) {
+                                int numChannels,
+                                double callbackTimeSeconds,
+                                bool *silent) {
+  if (silent) *silent = false;
   if (!internals->interleavedBuffer || !internals->resampler.input) return false;
-  internals->willRenderCallback(internals->clientdata);
+  if (internals->willRenderCallback) {
+    NFDriverTrace::begin("will_render");
+    internals->willRenderCallback(internals->clientdata);
+    NFDriverTrace::end("will_render");
+  }
 
   ATOMIC_SIGNED_INT nextSamplerate =
       ATOMICZERO(internals->nextSamplerate);  // Make it zero, return with the previous value.
   if (nextSamplerate != 0) {
-    internals->needsResampling = (nextSamplerate != NF_DRIVER_SAMPLERATE);
-    internals->resampler.rate =
-        static_cast<float>(NF_DRIVER_SAMPLERATE) / static_cast<float>(nextSamplerate);
-    internals->bufferCapacityToEndNeeded =
-        internals->needsResampling ? static_cast<int>((static_cast<float>(nextSamplerate) /
-                                                       static_cast<float>(NF_DRIVER_SAMPLERATE)) *
-                                                      (NF_DRIVER_SAMPLE_BLOCK_SIZE + 2))
-                                   : NF_DRIVER_SAMPLE_BLOCK_SIZE;
+    // The samplerate is stored in millihertz, to pass fractional rates
+    // atomically.
+    double samplerate = static_cast<double>(nextSamplerate) * 0.001;
+    internals->outputMillihertz = static_cast<uint64_t>(nextSamplerate);
+    updateResampling(internals);
+
+    // The latency bounds are in time, but the prebuffer is in output frames.
+    // Never let the prebuffer take more than the half of our buffer.
+    internals->samplerate = static_cast<int>(samplerate + 0.5);
+    int renderSamplerate = internals->nativeRate ? internals->samplerate : NF_DRIVER_SAMPLERATE;
+    if (renderSamplerate != internals->renderSamplerate) {
+      internals->renderSamplerate = renderSamplerate;
+      if (internals->samplerateCallback)
+        internals->samplerateCallback(internals->clientdata, renderSamplerate);
+    }
+    internals->minTargetFrames =
+        static_cast<int>(internals->minLatencyMs * 0.001f * static_cast<float>(samplerate));
+    internals->maxTargetFrames =
+        static_cast<int>(internals->maxLatencyMs * 0.001f * static_cast<float>(samplerate));
+    if (internals->maxTargetFrames > internals->bufferCapacityFrames / 2)
+      internals->maxTargetFrames = internals->bufferCapacityFrames / 2;
+    if (internals->minTargetFrames > internals->maxTargetFrames)
+      internals->minTargetFrames = internals->maxTargetFrames;
+    internals->targetFrames = internals->minTargetFrames;
+    internals->lastCallbackTime = -1.0;
+
+    // ASRC pulls up to twice the setpoint, keep that within our buffer too.
+    internals->asrcTargetFrames =
+        static_cast<int>(internals->asrcTargetMs * 0.001f * static_cast<float>(samplerate));
+    if (internals->asrcTargetFrames > internals->bufferCapacityFrames / 4)
+      internals->asrcTargetFrames = internals->bufferCapacityFrames / 4;
+    internals->asrcFill = internals->asrcTargetFrames;
+
+    // The master stage's ramps are in time too.
+    float rampFrames = internals->master.gainRampMs * 0.001f * static_cast<float>(samplerate);
+    internals->master.maxGainStepPerFrame = (rampFrames >= 1.0f) ? 1.0f / rampFrames : 1.0f;
+    internals->master.limiterReleasePerChunk =
+        static_cast<float>(LIMITER_CHUNK_FRAMES / (LIMITER_RELEASE_SECONDS * samplerate));
+  }
+  ATOMIC_SIGNED_INT nextSourceSamplerate = ATOMICZERO(internals->nextSourceSamplerate);
+  if (nextSourceSamplerate != 0) {
+    internals->sourceMillihertz = static_cast<uint64_t>(nextSourceSamplerate);
+    if (internals->outputMillihertz) updateResampling(internals);
+  }
+
+  // Direct mode only works without resampling, and the prebuffer of adaptive
+  // buffering would be pointless with it.
+  bool direct =
+      internals->direct && !internals->needsResampling && !internals->adaptiveBuffering;
+  int directFrames = 0;
+  if (direct && canRenderDirectly(internals, outputRight, numChannels)) {
+    directFrames = renderDirectly(internals, outputLeft, outputRight, numFrames, silent);
+    if (directFrames == numFrames) {
+      callDidRenderCallback(internals);
+      return true;
+    }
+    // A short render. The frames rendered are in the output already and will
+    // be played, the rest goes through our buffer as usual.
+    if (outputRight) {
+      outputLeft += directFrames;
+      outputRight += directFrames;
+    } else
+      outputLeft += directFrames * 2;
+    numFrames -= directFrames;
+    if (directFrames > 0) silent = NULL;  // Not the whole period.
   }
 
+  int framesNeeded = numFrames;
+  if (internals->adaptiveBuffering) {
+    if (callbackTimeSeconds < 0.0) callbackTimeSeconds = monotonicSeconds();
+    trackPeriodJitter(internals, callbackTimeSeconds, numFrames);
+    framesNeeded += internals->targetFrames;
+  }
+  // With ASRC our buffer is the elastic buffer between the two clocks. Pull
+  // everything the source has up to twice the setpoint, so the fill shows
+  // whether the source runs faster or slower than the output.
+  if (internals->asrc) framesNeeded = numFrames + internals->asrcTargetFrames * 2;
+
   // Render audio if needed.
-  while (internals->framesInBuffer < numFrames) {
+  bool sourceRanOut = false;
+  while (internals->framesInBuffer < framesNeeded) {
     // Do we have enough space in the buffer?
     if (internals->bufferCapacityToEndNeeded >
         (internals->bufferCapacityFrames - internals->writePositionFrames)) {
       // Memmove looks inefficient? This will happen only once in every second,
       // and all "virtual memory tricks" will do this anyway behind the curtain.
-      if (internals->framesInBuffer > 0)
+      if ((internals->framesInBuffer > 0) && internals->planarRenderCallback) {
+        float *left = internals->interleavedBuffer,
+              *right = internals->interleavedBuffer + internals->bufferCapacityFrames;
+        size_t bytes = static_cast<size_t>(internals->framesInBuffer) * sizeof(float);
+        memmove(left, left + internals->readPositionFrames, bytes);
+        memmove(right, right + internals->readPositionFrames, bytes);
+      } else if (internals->framesInBuffer > 0)
         memmove(internals->interleavedBuffer,
                 internals->interleavedBuffer + internals->readPositionFrames * 2,
                 static_cast<size_t>(internals->framesInBuffer) * sizeof(float) * 2);
@@ -218,42 +831,94 @@ bool NFDriverAdapter::getFrames(float *outputLeft,
       internals->writePositionFrames = internals->framesInBuffer;
     }
 
-    int framesRendered;
-    if (!internals->needsResampling) {  // No resampling needed, render directly
-                                        // into our buffer.
-      framesRendered = internals->renderCallback(
-          internals->clientdata,
-          internals->interleavedBuffer + internals->writePositionFrames * 2,
-          NF_DRIVER_SAMPLE_BLOCK_SIZE);
-      if (framesRendered <= 0) break;
-    } else {  // Resampling needed, render into the resampler's input buffer, the
-              // resample into our buffer.
-      framesRendered =
-          internals->renderCallback(internals->clientdata,
-                                    reinterpret_cast<float *>(internals->resampler.input),
-                                    NF_DRIVER_SAMPLE_BLOCK_SIZE);
-      if (framesRendered <= 0) break;
-      framesRendered = resample(internals->interleavedBuffer + internals->writePositionFrames * 2,
-                                &internals->resampler,
-                                framesRendered);
+    // Direct mode renders what is missing only, in one block at most.
+    int blockFrames = internals->blockFrames;
+    if (direct && (framesNeeded - internals->framesInBuffer < blockFrames))
+      blockFrames = framesNeeded - internals->framesInBuffer;
+
+    // Render directly into our buffer if no resampling is needed, into the
+    // resampler's input buffer otherwise. Planar audio goes to two planes.
+    float *left, *right;
+    if (!internals->needsResampling) {
+      left = internals->interleavedBuffer +
+             internals->writePositionFrames * (internals->planarRenderCallback ? 1 : 2);
+      right = left + internals->bufferCapacityFrames;
+    } else {
+      left = reinterpret_cast<float *>(internals->resampler.input);
+      right = left + NF_DRIVER_SAMPLE_BLOCK_SIZE;
     }
 
+    double renderStartTime = internals->adaptiveBuffering ? monotonicSeconds() : 0.0;
+    int result = callRenderCallback(internals, left, right, blockFrames);
+    int framesRendered = NF_DRIVER_RENDERED_FRAMES(result);
+    if (framesRendered <= 0) {
+      sourceRanOut = true;
+      break;
+    }
+    bool silentFrames = NF_DRIVER_IS_SILENCE(result);
+    if (silentFrames) clearFrames(internals, left, right, framesRendered);
+
+    bool sourceExhausted = false;
+    if (internals->needsResampling) {  // Resample into our buffer.
+      NFDriverTrace::begin("resample");
+      sourceExhausted = framesRendered < blockFrames;
+      if (internals->planarRenderCallback) {
+        float *outputLeft = internals->interleavedBuffer + internals->writePositionFrames;
+        framesRendered = resamplePlanar(outputLeft,
+                                        outputLeft + internals->bufferCapacityFrames,
+                                        &internals->resampler,
+                                        framesRendered);
+      } else
+        framesRendered = resample(internals->interleavedBuffer + internals->writePositionFrames * 2,
+                                  &internals->resampler,
+                                  framesRendered);
+      NFDriverTrace::end("resample");
+    }
+    if (internals->adaptiveBuffering)
+      trackRenderTime(internals, monotonicSeconds() - renderStartTime);
+
+    // The resampler interpolates the first frames of silence with the previous
+    // input, only count those after if that was audible.
+    if (!silentFrames)
+      internals->silentFramesAtEnd = 0;
+    else if (!internals->needsResampling || internals->previousBlockSilent)
+      internals->silentFramesAtEnd += framesRendered;
+    else {
+      int interpolatedFrames =
+          static_cast<int>(internals->resampler.den / internals->resampler.step) + 2;
+      if (framesRendered > interpolatedFrames)
+        internals->silentFramesAtEnd += framesRendered - interpolatedFrames;
+    }
+    internals->previousBlockSilent = silentFrames;
+
     internals->writePositionFrames += framesRendered;
     internals->framesInBuffer += framesRendered;
+    if (internals->asrc && sourceExhausted) {  // No more audio from the
+      sourceRanOut = true;                     // source's clock for now.
+      break;
+    }
   }
 
   // Output audio if possible.
   bool success = internals->framesInBuffer >= numFrames;
-  if (success) {
+  bool outputSilent = internals->silentFramesAtEnd >= internals->framesInBuffer;
+  if (success && silent && outputSilent) {  // Nothing to write.
+    *silent = true;
+    internals->readPositionFrames += numFrames;
+    if (internals->readPositionFrames >= internals->bufferCapacityFrames)
+      internals->readPositionFrames -= internals->bufferCapacityFrames;
+    internals->framesInBuffer -= numFrames;
+  } else if (success) {
     // Output numFrames of audio, or until the end of our buffer.
     int framesAvailableToEnd = internals->bufferCapacityFrames - internals->readPositionFrames;
     if (framesAvailableToEnd > numFrames) framesAvailableToEnd = numFrames;
 
-    makeOutput(internals->interleavedBuffer + internals->readPositionFrames * 2,
-               &outputLeft,
-               &outputRight,
-               framesAvailableToEnd,
-               numChannels);
+    makeOutputFromBuffer(internals,
+                         internals->readPositionFrames,
+                         &outputLeft,
+                         &outputRight,
+                         framesAvailableToEnd,
+                         numChannels);
     internals->readPositionFrames += framesAvailableToEnd;
     if (internals->readPositionFrames >= internals->bufferCapacityFrames)
       internals->readPositionFrames = 0;
@@ -261,28 +926,85 @@ bool NFDriverAdapter::getFrames(float *outputLeft,
     // Start from the beginning of our buffer if needed. (Wrap around.)
     int moreFrames = numFrames - framesAvailableToEnd;
     if (moreFrames > 0) {
-      makeOutput(internals->interleavedBuffer, &outputLeft, &outputRight, moreFrames, numChannels);
+      makeOutputFromBuffer(internals, 0, &outputLeft, &outputRight, moreFrames, numChannels);
       internals->readPositionFrames += moreFrames;
     }
 
     internals->framesInBuffer -= numFrames;
-  } else
-    internals->stutterCallback(internals->clientdata);
+  } else {
+    internals->stutterCallback(internals->stutterClientdata);
+    // The start of the period was rendered directly and must be played, only
+    // the rest is missing.
+    if (directFrames > 0) {
+      clearFrames(internals, outputLeft, outputRight, numFrames);
+      success = true;
+    }
+  }
+  if (internals->silentFramesAtEnd > internals->framesInBuffer)
+    internals->silentFramesAtEnd = internals->framesInBuffer;
 
-  internals->didRenderCallback(internals->clientdata);
+  if (internals->adaptiveBuffering) updateTargetFrames(internals, success);
+  if (internals->asrc) trimResamplingRatio(internals, numFrames, sourceRanOut);
+  callDidRenderCallback(internals);
   return success;
 }
 
+void NFDriverAdapter::setGain(float gain) {
+  internals->master.targetGain = gain;
+}
+
+void NFDriverAdapter::fadeIn() {
+  internals->master.gain = 0.0f;
+}
+
+float NFDriverAdapter::getGain() const {
+  return internals->master.gain;
+}
+
+void NFDriverAdapter::setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback) {
+  internals->samplerateCallback = callback;
+}
+
+void NFDriverAdapter::setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback) {
+  internals->planarRenderCallback = callback;
+}
+
+void NFDriverAdapter::setStutterCallback(NF_STUTTER_CALLBACK callback, void *clientdata) {
+  internals->stutterCallback = callback;
+  internals->stutterClientdata = clientdata;
+}
+
 void NFDriverAdapter::setSamplerate(int samplerate) {
-  internals->nextSamplerate = samplerate;
+  internals->nextSamplerate = samplerate * SAMPLERATE_SCALE;
   MEMORYBARRIER;
 }
 
-int NFDriverAdapter::getOptimalNumberOfFrames(int samplerate) {
-  if (samplerate == NF_DRIVER_SAMPLERATE) return NF_DRIVER_SAMPLE_BLOCK_SIZE;
+void NFDriverAdapter::setFractionalSamplerate(double samplerate) {
+  internals->nextSamplerate =
+      static_cast<ATOMIC_SIGNED_INT>(samplerate * static_cast<double>(SAMPLERATE_SCALE) + 0.5);
+  MEMORYBARRIER;
+}
+
+void NFDriverAdapter::setSourceSamplerate(double samplerate) {
+  if (samplerate <= 0.0) samplerate = NF_DRIVER_SAMPLERATE;
+  internals->nextSourceSamplerate =
+      static_cast<ATOMIC_SIGNED_INT>(samplerate * static_cast<double>(SAMPLERATE_SCALE) + 0.5);
+  MEMORYBARRIER;
+}
+
+int NFDriverAdapter::getOptimalNumberOfFrames(int samplerate, int blockFrames, bool nativeRate) {
+  if (nativeRate || (samplerate == NF_DRIVER_SAMPLERATE)) return blockFrames;
 
   float rate = static_cast<float>(samplerate) / static_cast<float>(NF_DRIVER_SAMPLERATE);
-  return int(NF_DRIVER_SAMPLE_BLOCK_SIZE * rate);
+  return int(blockFrames * rate);
+}
+
+int NFDriverAdapter::getBlockFrames() const {
+  return internals->blockFrames;
+}
+
+bool NFDriverAdapter::isNativeRate() const {
+  return internals->nativeRate;
 }
 
 }  // namespace driver
@@ -21,16 +21,69 @@
 #pragma once
 
 #include <NFDriver/NFDriver.h>
+#include <stdint.h>
 
 namespace nativeformat {
 namespace driver {
 
 struct NFDriverAdapterInternals;
 
+// Optional behaviour of the adapter, parsed from the createNFDriver options.
+typedef struct NFDriverAdapterSettings {
+  bool adaptiveBuffering;  // Keep a prebuffer sized by the measured callback
+                           // and render jitter.
+  float minLatencyMs, maxLatencyMs;  // Bounds of the adaptive prebuffer.
+  bool asrc;                         // Trim the resampling ratio to follow the
+                                     // clock of the audio provider.
+  float asrcTargetMs;                // The buffer fill ASRC keeps.
+  bool direct;  // Render the exact number of frames the audio I/O asks for,
+                // straight into its buffer if the format matches.
+  int blockFrames;  // Frames per render callback, up to NF_DRIVER_SAMPLE_BLOCK_SIZE.
+  bool nativeRate;  // Render at the output samplerate, without resampling.
+
+  // The master stage on the output.
+  float gainRampMs;      // How long a gain change from 0 to 1 takes.
+  bool fadeOut;          // Fade out over gainRampMs when stopping.
+  bool softClip;         // Bend peaks above -6 dB smoothly into full scale.
+  float limiterCeiling;  // Linear, zero disables the limiter.
+
+  int traceEvents;  // Events of the audio thread kept for writeTrace, zero for none.
+} NFDriverAdapterSettings;
+
+typedef enum {
+  NFSoundCardSchedulingPolicyFIFO,
+  NFSoundCardSchedulingPolicyDeadline,
+  NFSoundCardSchedulingPolicyOther
+} NFSoundCardSchedulingPolicy;
+
+// Optional behaviour of the sound card drivers, parsed from the createNFDriver
+// options.
+typedef struct NFSoundCardDriverSettings {
+  NFDriverAdapterSettings adapter;
+
+  // Audio thread tuning, Linux only.
+  uint64_t cpuAffinityMask;  // Zero leaves the affinity alone.
+  NFSoundCardSchedulingPolicy schedulingPolicy;
+  int schedulingPriority;      // Zero is 90% of the maximum SCHED_FIFO priority.
+  int deadlineRuntimePercent;  // SCHED_DEADLINE runtime in percent of the period.
+  bool lockMemory;             // mlockall and prefault the stack.
+  bool warmDevice;             // Pause instead of closing the device on setPlaying(false).
+
+  // ALSA buffering, Linux only. Zero is the default for each.
+  int periodSizeFrames;      // getOptimalNumberOfFrames by default.
+  int periodCount;           // As few as the device allows, 2 at least.
+  int startThresholdFrames;  // The whole buffer.
+  bool calibrateLatency;     // Measure, then keep as few periods queued as needed.
+  std::string deviceName;         // Empty for sysdefault.
+  std::string captureDeviceName;  // For setInputCallback.
+  bool deferCallbacks;  // Report stutters and errors of the audio thread from another thread.
+} NFSoundCardDriverSettings;
+
 // This class connects audio I/O to the audio provider (the player for example).
 // It will always ask the audio provider for 2 channels interleaved audio, with
-// fixed buffer size and fixed samplerate (in NFDriver.h). The class performs
-// buffering, resampling and deinterleaving automatically as needed.
+// fixed buffer size and fixed samplerate (in NFDriver.h), or the output's
+// samplerate with nativeRate. The class performs buffering, resampling and
+// deinterleaving automatically as needed.
 
 class NFDriverAdapter {
  public:
@@ -39,22 +92,54 @@ class NFDriverAdapter {
                   NF_RENDER_CALLBACK render_callback,
                   NF_ERROR_CALLBACK error_callback,
                   NF_WILL_RENDER_CALLBACK will_render_callback,
-                  NF_DID_RENDER_CALLBACK did_render_callback);
+                  NF_DID_RENDER_CALLBACK did_render_callback,
+                  const NFDriverAdapterSettings *settings = nullptr);
   ~NFDriverAdapter();
 
-  static int getOptimalNumberOfFrames(int samplerate);  // Returns with the ideal
-                                                        // number of frames for
-                                                        // the specific
-                                                        // samplerate for minimal
-                                                        // buffering and latency.
+  static int getOptimalNumberOfFrames(int samplerate,
+                                      int blockFrames = NF_DRIVER_SAMPLE_BLOCK_SIZE,
+                                      bool nativeRate = false);  // Returns with the ideal
+                                                                 // number of frames for
+                                                                 // the specific
+                                                                 // samplerate for minimal
+                                                                 // buffering and latency.
+  int getBlockFrames() const;  // Frames per render callback.
+  bool isNativeRate() const;   // Rendering at the output samplerate.
+
+  // Called before the first render at a new samplerate. Call it before the
+  // first getFrames.
+  void setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback);
 
+  // Ramps the output gain to this, linear. Call in the audio thread, before
+  // getFrames.
+  void setGain(float gain);
+  // The gain ramps up from 0 from the next getFrames, so starting doesn't
+  // click. Call in the audio thread.
+  void fadeIn();
+  float getGain() const;  // Where the ramp is at, 0 once faded out.
+  // Replaces the render callback with a planar one. Call before the first
+  // getFrames.
+  void setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback);
+  // Replaces the stutter callback, called with its own clientdata. Call before
+  // the first getFrames.
+  void setStutterCallback(NF_STUTTER_CALLBACK callback, void *clientdata);
   void setSamplerate(int samplerate);  // Thread-safe, can be called in any thread.
+  void setFractionalSamplerate(double samplerate);  // Same, with millihertz
+                                                    // precision.
+  // The samplerate the render callback's source actually runs at, such as the
+  // measured rate of a network stream. NF_DRIVER_SAMPLERATE by default or for
+  // zero. Thread-safe, ignored with nativeRate.
+  void setSourceSamplerate(double samplerate);
+  // Should be called in the audio processing/rendering callback of the audio
+  // I/O. The callback time is only used by adaptive buffering, negative means
+  // "now". If silent is given, silent output is not written, *silent is set
+  // to true instead.
   bool getFrames(float *outputLeft,
                  float *outputRight,
                  int numFrames,
-                 int numChannels);  // Should be called in the audio
-                                    // processing/rendering callback of the audio
-                                    // I/O.
+                 int numChannels,
+                 double callbackTimeSeconds = -1.0,
+                 bool *silent = nullptr);
 
  private:
   NFDriverAdapterInternals *internals;
@@ -66,13 +151,25 @@ class NFSoundCardDriver : public NFDriver {
  public:
   bool isPlaying() const;
   void setPlaying(bool playing);
+#if __linux__ && !__ANDROID__
+  std::map<std::string, std::string> getProperties() const;
+  bool getTimestamp(NFDriverTimestamp *timestamp) const;
+  void setWillRenderTimestampCallback(NF_WILL_RENDER_TIMESTAMP_CALLBACK callback);
+  bool setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback);
+  bool setGain(float gain);
+  bool setSourceSamplerate(double samplerate);
+  bool setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback);
+  bool setInputCallback(NF_INPUT_CALLBACK callback);
+  bool writeTrace(const char *path) const;
+#endif
 
   NFSoundCardDriver(void *clientdata,
                     NF_STUTTER_CALLBACK stutter_callback,
                     NF_RENDER_CALLBACK render_callback,
                     NF_ERROR_CALLBACK error_callback,
                     NF_WILL_RENDER_CALLBACK will_render_callback,
-                    NF_DID_RENDER_CALLBACK did_render_callback);
+                    NF_DID_RENDER_CALLBACK did_render_callback,
+                    const NFSoundCardDriverSettings &settings);
   ~NFSoundCardDriver();
 
  private:
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace nativeformat {
+namespace driver {
+
+// The backoff of a file driver whose render callback has no frames. The first
+// retry waits the minimum, every following one twice as long up to the
+// maximum, and the client's notifyDataAvailable ends a wait early.
+class NFDriverDataWaiter {
+ public:
+  NFDriverDataWaiter(int min_ms, int max_ms)
+      : _min_ms(std::max(min_ms, 0)),
+        _max_ms(std::max(max_ms, _min_ms)),
+        _delay_ms(0),
+        _notified(false) {}
+
+  // Render thread only.
+  void starved() { _delay_ms = (_delay_ms > 0) ? std::min(_delay_ms * 2, _max_ms) : _min_ms; }
+  void fed() { _delay_ms = 0; }
+  // Zero after a render with frames, or without a minimum.
+  int delayMs() const { return _delay_ms; }
+  void wait() {
+    if (_delay_ms < 1) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait_for(lock, std::chrono::milliseconds(_delay_ms), [this] { return _notified; });
+    _notified = false;
+  }
+
+  // Any thread. A notification before the wait ends the next wait right away.
+  void notify() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _notified = true;
+    _condition.notify_one();
+  }
+
+ private:
+  const int _min_ms, _max_ms;
+  int _delay_ms;
+  bool _notified;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+};
+
+}  // namespace driver
+}  // namespace nativeformat
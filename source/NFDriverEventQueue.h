@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace nativeformat {
+namespace driver {
+
+// Takes the stutter and error callbacks off the audio thread. The audio thread
+// only stores the event in a preallocated ring, without locks, allocations or
+// system calls, and a thread of normal priority calls the client's callbacks
+// a few milliseconds later. Error messages must be string literals, only the
+// pointer is stored.
+class NFDriverEventQueue {
+ public:
+  NFDriverEventQueue(void *clientdata,
+                     NF_STUTTER_CALLBACK stutter_callback,
+                     NF_ERROR_CALLBACK error_callback)
+      : _clientdata(clientdata),
+        _stutter_callback(stutter_callback),
+        _error_callback(error_callback),
+        _write_index(0),
+        _read_index(0),
+        _dropped_events(0),
+        _quit(false),
+        _thread(&NFDriverEventQueue::dispatch, this) {}
+
+  // Dispatches what's left.
+  ~NFDriverEventQueue() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _quit = true;
+    }
+    _condition.notify_one();
+    _thread.join();
+  }
+
+  // The callbacks for the audio thread, with the queue as the clientdata.
+  static void stutter(void *queue) { static_cast<NFDriverEventQueue *>(queue)->push(nullptr, 0); }
+  static void error(void *queue, const char *errorMessage, int errorCode) {
+    static_cast<NFDriverEventQueue *>(queue)->push(errorMessage, errorCode);
+  }
+
+ private:
+  enum { capacity = 256, dispatchIntervalMs = 10 };
+  typedef struct event {
+    const char *errorMessage;  // NULL for a stutter.
+    int errorCode;
+  } event;
+
+  void *_clientdata;
+  const NF_STUTTER_CALLBACK _stutter_callback;
+  const NF_ERROR_CALLBACK _error_callback;
+
+  event _events[capacity];
+  std::atomic<unsigned int> _write_index, _read_index;  // Wrapping.
+  std::atomic<int> _dropped_events;
+
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _quit;
+  std::thread _thread;
+
+  // Audio thread only. A full ring drops the event and counts it.
+  void push(const char *errorMessage, int errorCode) {
+    unsigned int write = _write_index.load(std::memory_order_relaxed);
+    if (write - _read_index.load(std::memory_order_acquire) >= capacity) {
+      _dropped_events.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    event &slot = _events[write % capacity];
+    slot.errorMessage = errorMessage;
+    slot.errorCode = errorCode;
+    _write_index.store(write + 1, std::memory_order_release);
+  }
+
+  void drain() {
+    unsigned int read = _read_index.load(std::memory_order_relaxed);
+    const unsigned int write = _write_index.load(std::memory_order_acquire);
+    for (; read != write; read++) {
+      const event slot = _events[read % capacity];
+      _read_index.store(read + 1, std::memory_order_release);
+      if (slot.errorMessage)
+        _error_callback(_clientdata, slot.errorMessage, slot.errorCode);
+      else
+        _stutter_callback(_clientdata);
+    }
+    int dropped = _dropped_events.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) _error_callback(_clientdata, "deferred events dropped", dropped);
+  }
+
+  void dispatch() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_quit) {
+      _condition.wait_for(lock, std::chrono::milliseconds(dispatchIntervalMs));
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+    lock.unlock();
+    drain();
+  }
+};
+
+}  // namespace driver
+}  // namespace nativeformat
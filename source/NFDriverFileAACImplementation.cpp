@@ -22,9 +22,12 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 
 #include <AudioToolbox/AudioToolbox.h>
 
+#include "NFDriverFileInput.h"
+
 namespace nativeformat {
 namespace driver {
 
@@ -36,7 +39,8 @@ NFDriverFileAACImplementation::NFDriverFileAACImplementation(
     NF_WILL_RENDER_CALLBACK will_render_callback,
     NF_DID_RENDER_CALLBACK did_render_callback,
     const char *output_destination,
-    int bitrate)
+    int bitrate,
+    const NFDriverFileSettings &settings)
     : _clientdata(clientdata),
       _stutter_callback(stutter_callback),
       _render_callback(render_callback),
@@ -45,35 +49,53 @@ NFDriverFileAACImplementation::NFDriverFileAACImplementation(
       _did_render_callback(did_render_callback),
       _output_destination(output_destination),
       _bitrate(bitrate),
-      _thread(nullptr) {}
+      _settings(settings),
+      _input_callback(nullptr),
+      _thread(nullptr),
+      _waiter(settings.retryMinMs, settings.retryMaxMs) {}
 
 NFDriverFileAACImplementation::~NFDriverFileAACImplementation() {
-  if (isPlaying()) {
-    setPlaying(false);
-  }
+  setPlaying(false);
 }
 
 bool NFDriverFileAACImplementation::isPlaying() const {
-  return !!_thread;
+  return _thread && _run;
 }
 
 void NFDriverFileAACImplementation::setPlaying(bool playing) {
-  if (isPlaying() == playing) {
+  if (playing && isPlaying()) {
     return;
   }
 
-  if (!playing) {
-    _run = false;
+  // After the input ended the driver stopped by itself, but its thread is
+  // still there to join, also before playing again.
+  _run = false;
+  if (_thread) {
+    _waiter.notify();
     if (std::this_thread::get_id() != _thread->get_id()) {
       _thread->join();
     }
     _thread = nullptr;
-  } else {
+  }
+  if (playing) {
     _run = true;
     _thread = std::make_shared<std::thread>(&NFDriverFileAACImplementation::run, this);
   }
 }
 
+bool NFDriverFileAACImplementation::setInputCallback(NF_INPUT_CALLBACK callback) {
+  if (_settings.inputFile.empty()) {
+    return false;
+  }
+  _input_callback = callback;
+  return true;
+}
+
+bool NFDriverFileAACImplementation::notifyDataAvailable() {
+  _waiter.notify();
+  return true;
+}
+
 void NFDriverFileAACImplementation::run(NFDriverFileAACImplementation *driver) {
   CFStringRef output_file_str =
       CFStringCreateWithCString(NULL, driver->_output_destination.c_str(), kCFStringEncodingUTF8);
@@ -169,24 +191,43 @@ void NFDriverFileAACImplementation::run(NFDriverFileAACImplementation *driver) {
   buffer_list.mBuffers[0].mData = malloc(buffer_list.mBuffers[0].mDataByteSize);
 
   // Run the driver
+  bool buffer_is_silent = false;
+  // Offline processing reads a block of the input before every render, and
+  // ends after the block the input ended in.
+  std::unique_ptr<NFDriverFileInput> input;
+  if (driver->_input_callback) {
+    input.reset(new NFDriverFileInput(
+        driver->_settings.inputFile, driver->_clientdata, driver->_error_callback));
+  }
   do {
+    const bool has_more_input =
+        !input || input->read(driver->_input_callback, driver->_clientdata);
     float *buffer = static_cast<float *>(buffer_list.mBuffers[0].mData);
-    const auto buffer_samples = NF_DRIVER_SAMPLE_BLOCK_SIZE * NF_DRIVER_CHANNELS;
-    for (int i = 0; i < buffer_samples; ++i) {
-      buffer[i] = 0.0f;
-    }
-    driver->_will_render_callback(driver->_clientdata);
-    const size_t num_frames =
-        (size_t)driver->_render_callback(driver->_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE);
+    if (driver->_will_render_callback) driver->_will_render_callback(driver->_clientdata);
+    const int render_result =
+        driver->_render_callback(driver->_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE);
+    const int num_frames = NF_DRIVER_RENDERED_FRAMES(render_result);
     if (num_frames < 1) {
       driver->_stutter_callback(driver->_clientdata);
+      driver->_waiter.starved();
     } else {
+      driver->_waiter.fed();
+      // Silence is written into the buffer once only.
+      if (NF_DRIVER_IS_SILENCE(render_result) && !buffer_is_silent) {
+        memset(buffer, 0, buffer_list.mBuffers[0].mDataByteSize);
+      }
+      buffer_is_silent = NF_DRIVER_IS_SILENCE(render_result);
       if ((result = ExtAudioFileWrite(audio_file, num_frames, &buffer_list)) != noErr) {
         driver->_error_callback(driver->_clientdata, "Failed to write frames to disk.", result);
         break;
       }
     }
-    driver->_did_render_callback(driver->_clientdata);
+    if (driver->_did_render_callback) driver->_did_render_callback(driver->_clientdata);
+    if (!has_more_input) {
+      driver->_run = false;
+      break;
+    }
+    driver->_waiter.wait();
   } while (driver->_run);
 
   // Cleanup
@@ -26,6 +26,8 @@
 #include <string>
 #include <thread>
 
+#include "NFDriverFileImplementation.h"
+
 namespace nativeformat {
 namespace driver {
 
@@ -33,6 +35,8 @@ class NFDriverFileAACImplementation : public NFDriver {
  public:
   bool isPlaying() const;
   void setPlaying(bool playing);
+  bool setInputCallback(NF_INPUT_CALLBACK callback);
+  bool notifyDataAvailable();
 
   NFDriverFileAACImplementation(void *clientdata,
                                 NF_STUTTER_CALLBACK stutter_callback,
@@ -41,7 +45,8 @@ class NFDriverFileAACImplementation : public NFDriver {
                                 NF_WILL_RENDER_CALLBACK will_render_callback,
                                 NF_DID_RENDER_CALLBACK did_render_callback,
                                 const char *output_destination,
-                                int bitrate);
+                                int bitrate,
+                                const NFDriverFileSettings &settings);
   ~NFDriverFileAACImplementation();
 
  private:
@@ -53,9 +58,13 @@ class NFDriverFileAACImplementation : public NFDriver {
   const NF_DID_RENDER_CALLBACK _did_render_callback;
   const std::string _output_destination;
   const int _bitrate;
+  const NFDriverFileSettings _settings;
+
+  NF_INPUT_CALLBACK _input_callback;
 
   std::shared_ptr<std::thread> _thread;
   std::atomic<bool> _run;
+  NFDriverDataWaiter _waiter;
 
   static void run(NFDriverFileAACImplementation *driver);
 };
@@ -21,8 +21,12 @@
 #include "NFDriverFileImplementation.h"
 
 #include <cstring>
+#include <memory>
 #include <vector>
 
+#include "NFDriverFileInput.h"
+#include "NFDriverWorkerPool.h"
+
 namespace nativeformat {
 namespace driver {
 
@@ -43,7 +47,8 @@ NFDriverFileImplementation::NFDriverFileImplementation(void *clientdata,
                                                        NF_WILL_RENDER_CALLBACK will_render_callback,
                                                        NF_DID_RENDER_CALLBACK did_render_callback,
                                                        const char *output_destination,
-                                                       NFDriverFileWAVHeaderAudioFormat wav_format)
+                                                       NFDriverFileWAVHeaderAudioFormat wav_format,
+                                                       const NFDriverFileSettings &settings)
     : _clientdata(clientdata),
       _stutter_callback(stutter_callback),
       _render_callback(render_callback),
@@ -52,111 +57,180 @@ NFDriverFileImplementation::NFDriverFileImplementation(void *clientdata,
       _did_render_callback(did_render_callback),
       _output_destination(output_destination),
       _wav_format(wav_format),
-      _thread(nullptr) {}
+      _settings(settings),
+      _input_callback(nullptr),
+      _thread(nullptr),
+      _waiter(settings.retryMinMs, settings.retryMaxMs),
+      _fhandle(nullptr) {}
 
 NFDriverFileImplementation::~NFDriverFileImplementation() {
-  if (isPlaying()) {
-    setPlaying(false);
-  }
+  setPlaying(false);
 }
 
 bool NFDriverFileImplementation::isPlaying() const {
-  return !!_thread;
+  return (_thread || _job) && _run;
 }
 
 void NFDriverFileImplementation::setPlaying(bool playing) {
-  if (isPlaying() == playing) {
+  if (playing && isPlaying()) {
     return;
   }
 
-  if (!playing) {
-    _run = false;
+  // After the input ended the driver stopped by itself, but its thread or job
+  // is still there to join, also before playing again.
+  _run = false;
+  if (_job) {
+    NFDriverWorkerPool::shared().wake(_job);
+    NFDriverWorkerPool::shared().wait(_job);
+    _job = nullptr;
+  } else if (_thread) {
+    _waiter.notify();
     if (std::this_thread::get_id() != _thread->get_id()) {
       _thread->join();
     }
     _thread = nullptr;
-  } else {
+  }
+  if (playing) {
     _run = true;
-    _thread = std::make_shared<std::thread>(&NFDriverFileImplementation::run, this);
+    if (_settings.sharedPool) {
+      // Every step renders a block, the first one begins the file.
+      bool began = false;
+      _job = NFDriverWorkerPool::shared().start([this, began]() mutable {
+        if (!began && !(began = begin())) {
+          return NF_DRIVER_WORKER_POOL_FINISHED;
+        }
+        if (_run && renderBlock()) {
+          return _waiter.delayMs();
+        }
+        end();
+        return NF_DRIVER_WORKER_POOL_FINISHED;
+      });
+    } else {
+      _thread = std::make_shared<std::thread>(&NFDriverFileImplementation::run, this);
+    }
+  }
+}
+
+bool NFDriverFileImplementation::setInputCallback(NF_INPUT_CALLBACK callback) {
+  if (_settings.inputFile.empty()) {
+    return false;
+  }
+  _input_callback = callback;
+  return true;
+}
+
+bool NFDriverFileImplementation::notifyDataAvailable() {
+  if (_job) {
+    NFDriverWorkerPool::shared().wake(_job);
+  } else {
+    _waiter.notify();
   }
+  return true;
 }
 
 void NFDriverFileImplementation::run(NFDriverFileImplementation *driver) {
-  FILE *fhandle = fopen(driver->_output_destination.c_str(), "wb");
-  if (fhandle == nullptr) {
-    driver->_error_callback(driver->_clientdata, "Failed to create file.", 0);
+  if (!driver->begin()) {
+    return;
+  }
+  while (driver->_run && driver->renderBlock()) {
+    driver->_waiter.wait();
+  }
+  driver->end();
+}
+
+bool NFDriverFileImplementation::begin() {
+  _fhandle = fopen(_output_destination.c_str(), "wb");
+  if (_fhandle == nullptr) {
+    _error_callback(_clientdata, "Failed to create file.", 0);
+    return false;
   }
 
   // Write the header.
-  struct {
-    unsigned char RIFF[4];
-    unsigned int chunkSize;
-    unsigned char WAVE[4];
-    unsigned char FMT[4];
-    unsigned int sixteen;
-    unsigned short int audioFormat;
-    unsigned short int numChannels;
-    unsigned int samplerate;
-    unsigned int byteRate;
-    unsigned short int blockAlign;
-    unsigned short int bitsPerSample;
-    unsigned char DATA[4];
-    unsigned int dataSize;
-  } header;
+  NFDriverFileWAVHeader header;
   std::memcpy(header.RIFF, "RIFF", 4);
   std::memcpy(header.WAVE, "WAVE", 4);
   std::memcpy(header.FMT, "fmt ", 4);
   header.sixteen = 16;
-  header.audioFormat = driver->_wav_format;
-  header.numChannels = NF_DRIVER_CHANNELS;
-  header.bitsPerSample = bytesPerFormat(driver->_wav_format) * 8;
-  header.samplerate = NF_DRIVER_SAMPLERATE;
-  header.byteRate = header.samplerate * header.numChannels * (header.bitsPerSample / 8);
-  header.blockAlign = header.numChannels * (header.bitsPerSample / 8);
+  header.format.audioFormat = _wav_format;
+  header.format.numChannels = NF_DRIVER_CHANNELS;
+  header.format.bitsPerSample = bytesPerFormat(_wav_format) * 8;
+  header.format.samplerate = NF_DRIVER_SAMPLERATE;
+  header.format.blockAlign = header.format.numChannels * (header.format.bitsPerSample / 8);
+  header.format.byteRate = header.format.samplerate * header.format.blockAlign;
   std::memcpy(header.DATA, "data", 4);
-  fwrite(&header, 1, sizeof(header), fhandle);
+  fwrite(&header, 1, sizeof(header), _fhandle);
+
+  _ends_with_hole = false;
+  // Offline processing reads a block of the input before every render, and
+  // ends after the block the input ended in.
+  if (_input_callback) {
+    _input.reset(new NFDriverFileInput(_settings.inputFile, _clientdata, _error_callback));
+  }
+  return true;
+}
 
-  // Rendering.
+bool NFDriverFileImplementation::renderBlock() {
   const auto buffer_samples = NF_DRIVER_SAMPLE_BLOCK_SIZE * NF_DRIVER_CHANNELS;
+  const auto sample_bytes = bytesPerFormat(_wav_format);
   float buffer[buffer_samples];
-  while (driver->_run) {
-    for (int i = 0; i < buffer_samples; ++i) {
-      buffer[i] = 0.0f;
-    }
-    driver->_will_render_callback(driver->_clientdata);
-    const size_t num_frames = static_cast<size_t>(
-        driver->_render_callback(driver->_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE));
-    if (num_frames < 1) {
-      driver->_stutter_callback(driver->_clientdata);
-    } else {
-      switch (driver->_wav_format) {
-        case NFDriverFileWAVHeaderAudioFormatPCM: {
-          std::vector<short> converted_samples(num_frames * NF_DRIVER_CHANNELS);
-          for (int i = 0; i < converted_samples.size(); ++i) {
-            converted_samples[i] =
-                static_cast<short>(buffer[i] * std::numeric_limits<short>::max());
-          }
-          fwrite(converted_samples.data(), sizeof(short), num_frames * NF_DRIVER_CHANNELS, fhandle);
-          break;
+  const bool has_more_input = !_input || _input->read(_input_callback, _clientdata);
+  if (_will_render_callback) _will_render_callback(_clientdata);
+  const int result = _render_callback(_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE);
+  const int num_frames = NF_DRIVER_RENDERED_FRAMES(result);
+  if (num_frames < 1) {
+    _stutter_callback(_clientdata);
+    _waiter.starved();
+  } else if (NF_DRIVER_IS_SILENCE(result)) {
+    _waiter.fed();
+    // Skipping silence leaves a hole in the file, which reads as zeros and
+    // is not even stored on file systems with sparse files.
+    fseek(_fhandle, static_cast<long>(num_frames * NF_DRIVER_CHANNELS * sample_bytes), SEEK_CUR);
+    _ends_with_hole = true;
+  } else {
+    _waiter.fed();
+    _ends_with_hole = false;
+    switch (_wav_format) {
+      case NFDriverFileWAVHeaderAudioFormatPCM: {
+        std::vector<short> converted_samples(num_frames * NF_DRIVER_CHANNELS);
+        for (int i = 0; i < converted_samples.size(); ++i) {
+          converted_samples[i] = static_cast<short>(buffer[i] * std::numeric_limits<short>::max());
         }
-        case NFDriverFileWAVHeaderAudioFormatIEEEFloat:
-          fwrite(buffer, sizeof(float), num_frames * NF_DRIVER_CHANNELS, fhandle);
-          break;
+        fwrite(converted_samples.data(), sizeof(short), converted_samples.size(), _fhandle);
+        break;
       }
+      case NFDriverFileWAVHeaderAudioFormatIEEEFloat:
+        fwrite(buffer, sizeof(float), num_frames * NF_DRIVER_CHANNELS, _fhandle);
+        break;
     }
+  }
+
+  if (_did_render_callback) _did_render_callback(_clientdata);
+  if (!has_more_input) {
+    _run = false;  // Stopped by itself, isPlaying() tells.
+  }
+  return has_more_input;
+}
 
-    driver->_did_render_callback(driver->_clientdata);
+void NFDriverFileImplementation::end() {
+  // A hole doesn't extend the file until something is written after it.
+  const auto sample_bytes = bytesPerFormat(_wav_format);
+  if (_ends_with_hole) {
+    const char zero[sizeof(float)] = {};
+    fseek(_fhandle, -static_cast<long>(sample_bytes), SEEK_CUR);
+    fwrite(zero, 1, sample_bytes, _fhandle);
   }
 
   // Write the size into the header and close the file.
-  unsigned int position =
-      static_cast<unsigned int>((static_cast<size_t>(ftell(fhandle)) - sizeof(header)));
-  fseek(fhandle, 40, SEEK_SET);
-  fwrite(&position, 1, 4, fhandle);
+  unsigned int position = static_cast<unsigned int>(
+      (static_cast<size_t>(ftell(_fhandle)) - sizeof(NFDriverFileWAVHeader)));
+  fseek(_fhandle, 40, SEEK_SET);
+  fwrite(&position, 1, 4, _fhandle);
   position += 36;
-  fseek(fhandle, 4, SEEK_SET);
-  fwrite(&position, 1, 4, fhandle);
-  fclose(fhandle);
+  fseek(_fhandle, 4, SEEK_SET);
+  fwrite(&position, 1, 4, _fhandle);
+  fclose(_fhandle);
+  _fhandle = nullptr;
+  _input = nullptr;
 }
 
 }  // namespace driver
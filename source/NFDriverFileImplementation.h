@@ -23,9 +23,14 @@
 #include <NFDriver/NFDriver.h>
 
 #include <atomic>
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <thread>
 
+#include "NFDriverDataWaiter.h"
+#include "NFDriverWorkerPool.h"
+
 namespace nativeformat {
 namespace driver {
 
@@ -34,10 +39,46 @@ typedef enum : short {
   NFDriverFileWAVHeaderAudioFormatIEEEFloat = 3
 } NFDriverFileWAVHeaderAudioFormat;
 
+// The body of the "fmt " chunk.
+typedef struct NFDriverFileWAVFormat {
+  unsigned short int audioFormat;
+  unsigned short int numChannels;
+  unsigned int samplerate;
+  unsigned int byteRate;
+  unsigned short int blockAlign;
+  unsigned short int bitsPerSample;
+} NFDriverFileWAVFormat;
+
+// The header written by NFDriverFileImplementation. Files written by others
+// may have more chunks, and in a different order.
+typedef struct NFDriverFileWAVHeader {
+  unsigned char RIFF[4];
+  unsigned int chunkSize;
+  unsigned char WAVE[4];
+  unsigned char FMT[4];
+  unsigned int sixteen;
+  NFDriverFileWAVFormat format;
+  unsigned char DATA[4];
+  unsigned int dataSize;
+} NFDriverFileWAVHeader;
+
+// Optional behaviour of the file drivers, parsed from the createNFDriver
+// options.
+typedef struct NFDriverFileSettings {
+  std::string inputFile;  // Passed to the input callback, empty for none.
+  bool sharedPool;        // Run on NFDriverWorkerPool::shared(), not a thread.
+  int retryMinMs, retryMaxMs;  // The NFDriverDataWaiter backoff after a render
+                               // without frames, zero retries right away.
+} NFDriverFileSettings;
+
+class NFDriverFileInput;
+
 class NFDriverFileImplementation : public NFDriver {
  public:
   bool isPlaying() const;
   void setPlaying(bool playing);
+  bool setInputCallback(NF_INPUT_CALLBACK callback);
+  bool notifyDataAvailable();
 
   NFDriverFileImplementation(void *clientdata,
                              NF_STUTTER_CALLBACK stutter_callback,
@@ -46,7 +87,8 @@ class NFDriverFileImplementation : public NFDriver {
                              NF_WILL_RENDER_CALLBACK will_render_callback,
                              NF_DID_RENDER_CALLBACK did_render_callback,
                              const char *output_destination,
-                             NFDriverFileWAVHeaderAudioFormat wav_format);
+                             NFDriverFileWAVHeaderAudioFormat wav_format,
+                             const NFDriverFileSettings &settings);
   ~NFDriverFileImplementation();
 
  private:
@@ -58,11 +100,24 @@ class NFDriverFileImplementation : public NFDriver {
   const NF_DID_RENDER_CALLBACK _did_render_callback;
   const std::string _output_destination;
   const NFDriverFileWAVHeaderAudioFormat _wav_format;
+  const NFDriverFileSettings _settings;
+
+  NF_INPUT_CALLBACK _input_callback;
 
   std::shared_ptr<std::thread> _thread;
+  std::shared_ptr<NFDriverWorkerPool::Job> _job;
   std::atomic<bool> _run;
+  NFDriverDataWaiter _waiter;
+
+  // The file being rendered, between the blocks.
+  FILE *_fhandle;
+  bool _ends_with_hole;
+  std::unique_ptr<NFDriverFileInput> _input;
 
   static void run(NFDriverFileImplementation *driver);
+  bool begin();
+  bool renderBlock();  // Returns false after the last block of the input.
+  void end();
 };
 
 }  // namespace driver
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include "NFDriverFileInput.h"
+
+#include <cstring>
+
+#include "NFDriverFileImplementation.h"
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// WAVE_FORMAT_EXTENSIBLE has the real format in the first two bytes of the
+// sub-format GUID, 24 bytes into the "fmt " chunk.
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_EXTENSIBLE_SUBFORMAT_OFFSET 24
+
+// The adapter's fixed point samplerates and buffer cover these. Below about
+// 1 kHz a block would need more input frames than its buffer holds.
+#define MIN_INPUT_SAMPLERATE 8000
+#define MAX_INPUT_SAMPLERATE 384000
+
+namespace nativeformat {
+namespace driver {
+
+static void noStutter(void *clientdata) {}
+
+NFDriverFileInput::NFDriverFileInput(const std::string &path,
+                                     void *clientdata,
+                                     NF_ERROR_CALLBACK error_callback)
+    : _clientdata(clientdata),
+      _error_callback(error_callback),
+      _file(nullptr),
+      _file_size(0),
+#if _WIN32
+      _file_handle(INVALID_HANDLE_VALUE),
+      _mapping_handle(nullptr),
+#endif
+      _samples(nullptr),
+      _samplerate(0),
+      _num_channels(0),
+      _bytes_per_sample(0),
+      _bytes_per_frame(0),
+      _is_float(false),
+      _num_frames(0),
+      _frames_converted(0),
+      _num_output_frames(0),
+      _frames_output(0) {
+  if (!map(path)) {
+    error_callback(clientdata, "Failed to open the input file.", 0);
+    return;
+  }
+  if (!parse()) {
+    error_callback(clientdata, "Unsupported input file format.", 0);
+    return;
+  }
+  if ((_samplerate < MIN_INPUT_SAMPLERATE) || (_samplerate > MAX_INPUT_SAMPLERATE)) {
+    error_callback(clientdata, "Unsupported input file samplerate.", _samplerate);
+    return;
+  }
+
+  // The file's frames are rendered at "NF_DRIVER_SAMPLERATE" for the adapter,
+  // so outputting at NF_DRIVER_SAMPLERATE^2 / samplerate converts them to
+  // NF_DRIVER_SAMPLERATE.
+  _num_output_frames = (_num_frames * NF_DRIVER_SAMPLERATE + _samplerate - 1) / _samplerate;
+  _adapter.reset(
+      new NFDriverAdapter(this, noStutter, convert, error, nullptr, nullptr, nullptr));
+  _adapter->setFractionalSamplerate(static_cast<double>(NF_DRIVER_SAMPLERATE) *
+                                    static_cast<double>(NF_DRIVER_SAMPLERATE) /
+                                    static_cast<double>(_samplerate));
+}
+
+NFDriverFileInput::~NFDriverFileInput() {
+#if _WIN32
+  if (_file) UnmapViewOfFile(_file);
+  if (_mapping_handle) CloseHandle(_mapping_handle);
+  if (_file_handle != INVALID_HANDLE_VALUE) CloseHandle(_file_handle);
+#else
+  if (_file) munmap(const_cast<unsigned char *>(_file), _file_size);
+#endif
+}
+
+bool NFDriverFileInput::map(const std::string &path) {
+#if _WIN32
+  _file_handle = CreateFileA(path.c_str(),
+                             GENERIC_READ,
+                             FILE_SHARE_READ,
+                             nullptr,
+                             OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN,
+                             nullptr);
+  if (_file_handle == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(_file_handle, &size) || (size.QuadPart < 1)) return false;
+  _mapping_handle = CreateFileMappingA(_file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!_mapping_handle) return false;
+  _file = static_cast<const unsigned char *>(
+      MapViewOfFile(_mapping_handle, FILE_MAP_READ, 0, 0, 0));
+  _file_size = static_cast<size_t>(size.QuadPart);
+  return _file != nullptr;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if ((fstat(fd, &info) != 0) || (info.st_size < 1)) {
+    close(fd);
+    return false;
+  }
+  void *file = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps the file open.
+  if (file == MAP_FAILED) return false;
+  // Read once from start to end.
+  madvise(file, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+  _file = static_cast<const unsigned char *>(file);
+  _file_size = static_cast<size_t>(info.st_size);
+  return true;
+#endif
+}
+
+// Walks the chunks for "fmt " and "data", both little endian like the header
+// NFDriverFileImplementation writes.
+bool NFDriverFileInput::parse() {
+  if ((_file_size < 12) || memcmp(_file, "RIFF", 4) || memcmp(_file + 8, "WAVE", 4))
+    return false;
+
+  NFDriverFileWAVFormat format;
+  bool has_format = false;
+  size_t data_size = 0;
+  size_t offset = 12;
+  while ((offset + 8 <= _file_size) && (!has_format || !_samples)) {
+    const unsigned char *chunk = _file + offset;
+    unsigned int chunk_size;
+    memcpy(&chunk_size, chunk + 4, 4);
+    size_t available = _file_size - offset - 8;
+    if (!memcmp(chunk, "fmt ", 4) && (chunk_size >= sizeof(format)) &&
+        (available >= chunk_size)) {
+      memcpy(&format, chunk + 8, sizeof(format));
+      if ((format.audioFormat == WAV_FORMAT_EXTENSIBLE) &&
+          (chunk_size >= WAV_EXTENSIBLE_SUBFORMAT_OFFSET + 2))
+        memcpy(&format.audioFormat, chunk + 8 + WAV_EXTENSIBLE_SUBFORMAT_OFFSET, 2);
+      has_format = true;
+    } else if (!memcmp(chunk, "data", 4)) {
+      // Writers that never finished the file leave the size at zero or too
+      // big, the data lasts until the end of the file then.
+      _samples = chunk + 8;
+      data_size = ((chunk_size == 0) || (chunk_size > available)) ? available : chunk_size;
+    }
+    offset += 8 + static_cast<size_t>(chunk_size) + (chunk_size & 1);  // Padded to words.
+  }
+  if (!has_format || !_samples || (format.numChannels < 1) || (format.samplerate < 1))
+    return false;
+
+  switch (format.audioFormat) {
+    case NFDriverFileWAVHeaderAudioFormatPCM:
+      if ((format.bitsPerSample != 16) && (format.bitsPerSample != 24) &&
+          (format.bitsPerSample != 32))
+        return false;
+      break;
+    case NFDriverFileWAVHeaderAudioFormatIEEEFloat:
+      if (format.bitsPerSample != 32) return false;
+      _is_float = true;
+      break;
+    default:
+      return false;
+  }
+  _samplerate = static_cast<int>(format.samplerate);
+  _num_channels = format.numChannels;
+  _bytes_per_sample = format.bitsPerSample / 8;
+  _bytes_per_frame = _bytes_per_sample * _num_channels;
+  _num_frames = static_cast<long long>(data_size / _bytes_per_frame);
+  return true;
+}
+
+float NFDriverFileInput::sample(const unsigned char *sample) const {
+  // The file is not aligned for the samples, memcpy reads them safely.
+  switch (_bytes_per_sample) {
+    case 2: {
+      short value;
+      memcpy(&value, sample, 2);
+      return static_cast<float>(value) * (1.0f / 32768.0f);
+    }
+    case 3: {
+      int value = static_cast<int>(static_cast<unsigned int>(sample[0]) << 8 |
+                                   static_cast<unsigned int>(sample[1]) << 16 |
+                                   static_cast<unsigned int>(sample[2]) << 24);
+      return static_cast<float>(value) * (1.0f / 2147483648.0f);
+    }
+    default:
+      if (_is_float) {
+        float value;
+        memcpy(&value, sample, 4);
+        return value;
+      } else {
+        int value;
+        memcpy(&value, sample, 4);
+        return static_cast<float>(value) * (1.0f / 2147483648.0f);
+      }
+  }
+}
+
+// The adapter's render callback, reading the file at its own samplerate. Mono
+// is played on both channels, and only the first two channels of more are
+// read. Silence follows the end, while the resampler drains.
+int NFDriverFileInput::convert(void *clientdata, float *frames, int numberOfFrames) {
+  NFDriverFileInput *input = static_cast<NFDriverFileInput *>(clientdata);
+  long long remaining = input->_num_frames - input->_frames_converted;
+  int numFrames = (remaining < numberOfFrames) ? static_cast<int>(remaining) : numberOfFrames;
+  const unsigned char *frame = input->_samples + input->_frames_converted * input->_bytes_per_frame;
+  const int right_offset = (input->_num_channels > 1) ? input->_bytes_per_sample : 0;
+
+  for (int n = 0; n < numFrames; n++, frame += input->_bytes_per_frame) {
+    *frames++ = input->sample(frame);
+    *frames++ = input->sample(frame + right_offset);
+  }
+  if (numFrames < numberOfFrames)
+    memset(frames, 0, (numberOfFrames - numFrames) * NF_DRIVER_CHANNELS * sizeof(float));
+
+  input->_frames_converted += numFrames;
+  return numberOfFrames;
+}
+
+// The adapter's error callback, with the driver's clientdata.
+void NFDriverFileInput::error(void *clientdata, const char *errorMessage, int errorCode) {
+  NFDriverFileInput *input = static_cast<NFDriverFileInput *>(clientdata);
+  input->_error_callback(input->_clientdata, errorMessage, errorCode);
+}
+
+bool NFDriverFileInput::read(NF_INPUT_CALLBACK input_callback, void *clientdata) {
+  // A file that couldn't be read ends right away, with an empty block.
+  float frames[NF_DRIVER_SAMPLE_BLOCK_SIZE * NF_DRIVER_CHANNELS];
+  long long remaining = _num_output_frames - _frames_output;
+  int numFrames = (remaining < NF_DRIVER_SAMPLE_BLOCK_SIZE) ? static_cast<int>(remaining)
+                                                            : NF_DRIVER_SAMPLE_BLOCK_SIZE;
+  if ((numFrames > 0) && !_adapter->getFrames(frames, nullptr, numFrames, NF_DRIVER_CHANNELS))
+    numFrames = 0;
+  _frames_output += numFrames;
+  input_callback(clientdata, frames, numFrames);
+  return numFrames == NF_DRIVER_SAMPLE_BLOCK_SIZE;
+}
+
+}  // namespace driver
+}  // namespace nativeformat
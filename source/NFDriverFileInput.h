@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <NFDriver/NFDriver.h>
+
+#include <memory>
+#include <string>
+
+#include "NFDriverAdapter.h"
+
+namespace nativeformat {
+namespace driver {
+
+// Reads a 16, 24 or 32 bit PCM or 32 bit float WAV file of any samplerate and
+// channel count through a memory map, and passes it to an input callback in
+// blocks of NF_DRIVER_SAMPLE_BLOCK_SIZE frames, NF_DRIVER_CHANNELS interleaved
+// channels at NF_DRIVER_SAMPLERATE. The adapter does the resampling: it asks
+// for the file's frames as if they were rendered, and outputs them at
+// NF_DRIVER_SAMPLERATE.
+class NFDriverFileInput {
+ public:
+  NFDriverFileInput(const std::string &path, void *clientdata, NF_ERROR_CALLBACK error_callback);
+  ~NFDriverFileInput();
+
+  // Passes the next block to the callback. Returns false after the last block,
+  // which is shorter than NF_DRIVER_SAMPLE_BLOCK_SIZE frames, and empty if the
+  // file couldn't be read.
+  bool read(NF_INPUT_CALLBACK input_callback, void *clientdata);
+
+ private:
+  void *_clientdata;
+  const NF_ERROR_CALLBACK _error_callback;
+  const unsigned char *_file;
+  size_t _file_size;
+#if _WIN32
+  void *_file_handle, *_mapping_handle;
+#endif
+
+  const unsigned char *_samples;  // The data chunk.
+  int _samplerate, _num_channels, _bytes_per_sample, _bytes_per_frame;
+  bool _is_float;
+  long long _num_frames, _frames_converted;
+  long long _num_output_frames, _frames_output;
+  std::unique_ptr<NFDriverAdapter> _adapter;
+
+  bool map(const std::string &path);
+  bool parse();
+  float sample(const unsigned char *sample) const;
+  static int convert(void *clientdata, float *frames, int numberOfFrames);
+  static void error(void *clientdata, const char *errorMessage, int errorCode);
+};
+
+}  // namespace driver
+}  // namespace nativeformat
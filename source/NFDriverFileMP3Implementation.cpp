@@ -22,6 +22,7 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #if _WIN32
 #include <windows.h>
 #else
@@ -30,9 +31,36 @@
 
 #include <lame.h>
 
+#include "NFDriverFileInput.h"
+#include "NFDriverWorkerPool.h"
+
 namespace nativeformat {
 namespace driver {
 
+// The encoding in progress, between the blocks.
+struct NFDriverFileMP3Encoder {
+#if _WIN32
+  HINSTANCE lame_handle;
+#else
+  void *lame_handle;
+#endif
+  decltype(&lame_init) lame_init_dynamic;
+  decltype(&lame_set_in_samplerate) lame_set_in_samplerate_dynamic;
+  decltype(&lame_set_VBR) lame_set_VBR_dynamic;
+  decltype(&lame_init_params) lame_init_params_dynamic;
+  decltype(&lame_encode_buffer_interleaved_ieee_float)
+      lame_encode_buffer_interleaved_ieee_float_dynamic;
+  decltype(&lame_encode_flush) lame_encode_flush_dynamic;
+  decltype(&lame_close) lame_close_dynamic;
+  decltype(&lame_set_mode) lame_set_mode_dynamic;
+  decltype(&lame_set_VBR_mean_bitrate_kbps) lame_set_VBR_mean_bitrate_kbps_dynamic;
+
+  FILE *fhandle;
+  lame_t lame;
+  unsigned char mp3_buffer[8192];
+  std::unique_ptr<NFDriverFileInput> input;
+};
+
 NFDriverFileMP3Implementation::NFDriverFileMP3Implementation(
     void *clientdata,
     NF_STUTTER_CALLBACK stutter_callback,
@@ -41,7 +69,8 @@ NFDriverFileMP3Implementation::NFDriverFileMP3Implementation(
     NF_WILL_RENDER_CALLBACK will_render_callback,
     NF_DID_RENDER_CALLBACK did_render_callback,
     const char *output_destination,
-    int bitrate)
+    int bitrate,
+    const NFDriverFileSettings &settings)
     : _clientdata(clientdata),
       _stutter_callback(stutter_callback),
       _render_callback(render_callback),
@@ -50,128 +79,201 @@ NFDriverFileMP3Implementation::NFDriverFileMP3Implementation(
       _did_render_callback(did_render_callback),
       _output_destination(output_destination),
       _bitrate(bitrate),
-      _thread(nullptr) {}
+      _settings(settings),
+      _input_callback(nullptr),
+      _thread(nullptr),
+      _waiter(settings.retryMinMs, settings.retryMaxMs) {}
 
 NFDriverFileMP3Implementation::~NFDriverFileMP3Implementation() {
-  if (isPlaying()) {
-    setPlaying(false);
-  }
+  setPlaying(false);
 }
 
 bool NFDriverFileMP3Implementation::isPlaying() const {
-  return !!_thread;
+  return (_thread || _job) && _run;
 }
 
 void NFDriverFileMP3Implementation::setPlaying(bool playing) {
-  if (isPlaying() == playing) {
+  if (playing && isPlaying()) {
     return;
   }
 
-  if (!playing) {
-    _run = false;
+  // After the input ended the driver stopped by itself, but its thread or job
+  // is still there to join, also before playing again.
+  _run = false;
+  if (_job) {
+    NFDriverWorkerPool::shared().wake(_job);
+    NFDriverWorkerPool::shared().wait(_job);
+    _job = nullptr;
+  } else if (_thread) {
+    _waiter.notify();
     if (std::this_thread::get_id() != _thread->get_id()) {
       _thread->join();
     }
     _thread = nullptr;
-  } else {
+  }
+  if (playing) {
     _run = true;
-    _thread = std::make_shared<std::thread>(&NFDriverFileMP3Implementation::run, this);
+    if (_settings.sharedPool) {
+      // Every step encodes a block, the first one opens LAME and the file.
+      bool began = false;
+      _job = NFDriverWorkerPool::shared().start([this, began]() mutable {
+        if (!began && !(began = begin())) {
+          return NF_DRIVER_WORKER_POOL_FINISHED;
+        }
+        if (renderBlock() && _run) {
+          return _waiter.delayMs();
+        }
+        end();
+        return NF_DRIVER_WORKER_POOL_FINISHED;
+      });
+    } else {
+      _thread = std::make_shared<std::thread>(&NFDriverFileMP3Implementation::run, this);
+    }
+  }
+}
+
+bool NFDriverFileMP3Implementation::setInputCallback(NF_INPUT_CALLBACK callback) {
+  if (_settings.inputFile.empty()) {
+    return false;
   }
+  _input_callback = callback;
+  return true;
+}
+
+bool NFDriverFileMP3Implementation::notifyDataAvailable() {
+  if (_job) {
+    NFDriverWorkerPool::shared().wake(_job);
+  } else {
+    _waiter.notify();
+  }
+  return true;
 }
 
 void NFDriverFileMP3Implementation::run(NFDriverFileMP3Implementation *driver) {
+  if (!driver->begin()) {
+    return;
+  }
+  while (driver->renderBlock() && driver->_run) {
+    driver->_waiter.wait();
+  }
+  driver->end();
+}
+
+bool NFDriverFileMP3Implementation::begin() {
+  _encoder.reset(new NFDriverFileMP3Encoder);
+  NFDriverFileMP3Encoder &encoder = *_encoder;
+
   // Open LAME lib
   std::string lame_lib_path(getenv("LAME_DYLIB"));
 #if _WIN32
   HINSTANCE lame_handle = LoadLibrary(lame_lib_path.c_str());
-  decltype(&lame_init) lame_init_dynamic =
-      (decltype(&lame_init))GetProcAddress(lame_handle, "lame_init");
-  decltype(&lame_set_in_samplerate) lame_set_in_samplerate_dynamic =
+  encoder.lame_handle = lame_handle;
+  encoder.lame_init_dynamic = (decltype(&lame_init))GetProcAddress(lame_handle, "lame_init");
+  encoder.lame_set_in_samplerate_dynamic =
       (decltype(&lame_set_in_samplerate))GetProcAddress(lame_handle, "lame_set_in_samplerate");
-  decltype(&lame_set_VBR) lame_set_VBR_dynamic =
+  encoder.lame_set_VBR_dynamic =
       (decltype(&lame_set_VBR))GetProcAddress(lame_handle, "lame_set_VBR");
-  decltype(&lame_init_params) lame_init_params_dynamic =
+  encoder.lame_init_params_dynamic =
       (decltype(&lame_init_params))GetProcAddress(lame_handle, "lame_init_params");
-  decltype(&lame_encode_buffer_interleaved_ieee_float)
-      lame_encode_buffer_interleaved_ieee_float_dynamic =
-          (decltype(&lame_encode_buffer_interleaved_ieee_float))GetProcAddress(
-              lame_handle, "lame_encode_buffer_interleaved_ieee_float");
-  decltype(&lame_encode_flush) lame_encode_flush_dynamic =
+  encoder.lame_encode_buffer_interleaved_ieee_float_dynamic =
+      (decltype(&lame_encode_buffer_interleaved_ieee_float))GetProcAddress(
+          lame_handle, "lame_encode_buffer_interleaved_ieee_float");
+  encoder.lame_encode_flush_dynamic =
       (decltype(&lame_encode_flush))GetProcAddress(lame_handle, "lame_encode_flush");
-  decltype(&lame_close) lame_close_dynamic =
-      (decltype(&lame_close))GetProcAddress(lame_handle, "lame_close");
-  decltype(&lame_set_mode) lame_set_mode_dynamic =
+  encoder.lame_close_dynamic = (decltype(&lame_close))GetProcAddress(lame_handle, "lame_close");
+  encoder.lame_set_mode_dynamic =
       (decltype(&lame_set_mode))GetProcAddress(lame_handle, "lame_set_mode");
-  decltype(&lame_set_VBR_mean_bitrate_kbps) lame_set_VBR_mean_bitrate_kbps_dynamic =
+  encoder.lame_set_VBR_mean_bitrate_kbps_dynamic =
       (decltype(&lame_set_VBR_mean_bitrate_kbps))GetProcAddress(lame_handle,
                                                                 "lame_set_VBR_mean_bitrate_kbps");
 #else
   void *lame_handle = dlopen(lame_lib_path.c_str(), RTLD_LAZY);
-  decltype(&lame_init) lame_init_dynamic = (decltype(&lame_init))dlsym(lame_handle, "lame_init");
-  decltype(&lame_set_in_samplerate) lame_set_in_samplerate_dynamic =
+  encoder.lame_handle = lame_handle;
+  encoder.lame_init_dynamic = (decltype(&lame_init))dlsym(lame_handle, "lame_init");
+  encoder.lame_set_in_samplerate_dynamic =
       (decltype(&lame_set_in_samplerate))dlsym(lame_handle, "lame_set_in_samplerate");
-  decltype(&lame_set_VBR) lame_set_VBR_dynamic =
-      (decltype(&lame_set_VBR))dlsym(lame_handle, "lame_set_VBR");
-  decltype(&lame_init_params) lame_init_params_dynamic =
+  encoder.lame_set_VBR_dynamic = (decltype(&lame_set_VBR))dlsym(lame_handle, "lame_set_VBR");
+  encoder.lame_init_params_dynamic =
       (decltype(&lame_init_params))dlsym(lame_handle, "lame_init_params");
-  decltype(&lame_encode_buffer_interleaved_ieee_float)
-      lame_encode_buffer_interleaved_ieee_float_dynamic =
-          (decltype(&lame_encode_buffer_interleaved_ieee_float))dlsym(
-              lame_handle, "lame_encode_buffer_interleaved_ieee_float");
-  decltype(&lame_encode_flush) lame_encode_flush_dynamic =
+  encoder.lame_encode_buffer_interleaved_ieee_float_dynamic =
+      (decltype(&lame_encode_buffer_interleaved_ieee_float))dlsym(
+          lame_handle, "lame_encode_buffer_interleaved_ieee_float");
+  encoder.lame_encode_flush_dynamic =
       (decltype(&lame_encode_flush))dlsym(lame_handle, "lame_encode_flush");
-  decltype(&lame_close) lame_close_dynamic =
-      (decltype(&lame_close))dlsym(lame_handle, "lame_close");
-  decltype(&lame_set_mode) lame_set_mode_dynamic =
-      (decltype(&lame_set_mode))dlsym(lame_handle, "lame_set_mode");
-  decltype(&lame_set_VBR_mean_bitrate_kbps) lame_set_VBR_mean_bitrate_kbps_dynamic =
+  encoder.lame_close_dynamic = (decltype(&lame_close))dlsym(lame_handle, "lame_close");
+  encoder.lame_set_mode_dynamic = (decltype(&lame_set_mode))dlsym(lame_handle, "lame_set_mode");
+  encoder.lame_set_VBR_mean_bitrate_kbps_dynamic =
       (decltype(&lame_set_VBR_mean_bitrate_kbps))dlsym(lame_handle,
                                                        "lame_set_VBR_mean_bitrate_kbps");
 #endif
 
   // Open file
-  FILE *fhandle = fopen(driver->_output_destination.c_str(), "wb");
-  if (fhandle == nullptr) {
-    driver->_error_callback(driver->_clientdata, "Failed to create file.", 0);
+  encoder.fhandle = fopen(_output_destination.c_str(), "wb");
+  if (encoder.fhandle == nullptr) {
+    _error_callback(_clientdata, "Failed to create file.", 0);
   }
 
   // Open LAME
-  lame_t lame = lame_init_dynamic();
-  lame_set_in_samplerate_dynamic(lame, NF_DRIVER_SAMPLERATE);
-  lame_set_VBR_dynamic(lame, vbr_default);
-  lame_set_mode_dynamic(lame, STEREO);
-  lame_set_VBR_mean_bitrate_kbps_dynamic(lame, driver->_bitrate);
-  lame_init_params_dynamic(lame);
-
-  // Perform Encoding
-  unsigned char mp3_buffer[8192];
-  do {
-    const auto buffer_samples = NF_DRIVER_SAMPLE_BLOCK_SIZE * NF_DRIVER_CHANNELS;
-    float buffer[buffer_samples];
-    for (int i = 0; i < buffer_samples; ++i) {
-      buffer[i] = 0.0f;
-    }
-    driver->_will_render_callback(driver->_clientdata);
-    const size_t num_frames =
-        (size_t)driver->_render_callback(driver->_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE);
-    if (num_frames < 1) {
-      driver->_stutter_callback(driver->_clientdata);
-    } else {
-      const auto write = lame_encode_buffer_interleaved_ieee_float_dynamic(
-          lame, buffer, num_frames, mp3_buffer, sizeof(mp3_buffer));
-      fwrite(mp3_buffer, write, 1, fhandle);
-    }
-    driver->_did_render_callback(driver->_clientdata);
-  } while (driver->_run);
-  const auto write = lame_encode_flush_dynamic(lame, mp3_buffer, sizeof(mp3_buffer));
-  fwrite(mp3_buffer, write, 1, fhandle);
+  encoder.lame = encoder.lame_init_dynamic();
+  encoder.lame_set_in_samplerate_dynamic(encoder.lame, NF_DRIVER_SAMPLERATE);
+  encoder.lame_set_VBR_dynamic(encoder.lame, vbr_default);
+  encoder.lame_set_mode_dynamic(encoder.lame, STEREO);
+  encoder.lame_set_VBR_mean_bitrate_kbps_dynamic(encoder.lame, _bitrate);
+  encoder.lame_init_params_dynamic(encoder.lame);
+
+  // Offline processing reads a block of the input before every render, and
+  // ends after the block the input ended in.
+  if (_input_callback) {
+    encoder.input.reset(new NFDriverFileInput(_settings.inputFile, _clientdata, _error_callback));
+  }
+  return true;
+}
+
+// Perform Encoding
+bool NFDriverFileMP3Implementation::renderBlock() {
+  NFDriverFileMP3Encoder &encoder = *_encoder;
+  const auto buffer_samples = NF_DRIVER_SAMPLE_BLOCK_SIZE * NF_DRIVER_CHANNELS;
+  float buffer[buffer_samples];
+  static const float silence[buffer_samples] = {};
+  const bool has_more_input =
+      !encoder.input || encoder.input->read(_input_callback, _clientdata);
+  if (_will_render_callback) _will_render_callback(_clientdata);
+  const int result = _render_callback(_clientdata, buffer, NF_DRIVER_SAMPLE_BLOCK_SIZE);
+  const int num_frames = NF_DRIVER_RENDERED_FRAMES(result);
+  if (num_frames < 1) {
+    _stutter_callback(_clientdata);
+    _waiter.starved();
+  } else {
+    _waiter.fed();
+    // Silence is encoded from a buffer of zeros, not touching the render buffer.
+    const auto write = encoder.lame_encode_buffer_interleaved_ieee_float_dynamic(
+        encoder.lame,
+        NF_DRIVER_IS_SILENCE(result) ? silence : buffer,
+        num_frames,
+        encoder.mp3_buffer,
+        sizeof(encoder.mp3_buffer));
+    fwrite(encoder.mp3_buffer, write, 1, encoder.fhandle);
+  }
+  if (_did_render_callback) _did_render_callback(_clientdata);
+  if (!has_more_input) {
+    _run = false;  // Stopped by itself, isPlaying() tells.
+  }
+  return has_more_input;
+}
+
+void NFDriverFileMP3Implementation::end() {
+  NFDriverFileMP3Encoder &encoder = *_encoder;
+  const auto write = encoder.lame_encode_flush_dynamic(
+      encoder.lame, encoder.mp3_buffer, sizeof(encoder.mp3_buffer));
+  fwrite(encoder.mp3_buffer, write, 1, encoder.fhandle);
 
   // Cleanup
-  lame_close_dynamic(lame);
-  fclose(fhandle);
+  encoder.lame_close_dynamic(encoder.lame);
+  fclose(encoder.fhandle);
 #ifndef _WIN32
-  dlclose(lame_handle);
+  dlclose(encoder.lame_handle);
 #endif
+  _encoder = nullptr;
 }
 
 }  // namespace driver
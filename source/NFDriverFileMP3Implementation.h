@@ -23,16 +23,24 @@
 #include <NFDriver/NFDriver.h>
 
 #include <atomic>
+#include <memory>
 #include <string>
 #include <thread>
 
+#include "NFDriverFileImplementation.h"
+#include "NFDriverWorkerPool.h"
+
 namespace nativeformat {
 namespace driver {
 
+struct NFDriverFileMP3Encoder;
+
 class NFDriverFileMP3Implementation : public NFDriver {
  public:
   bool isPlaying() const;
   void setPlaying(bool playing);
+  bool setInputCallback(NF_INPUT_CALLBACK callback);
+  bool notifyDataAvailable();
 
   NFDriverFileMP3Implementation(void *clientdata,
                                 NF_STUTTER_CALLBACK stutter_callback,
@@ -41,7 +49,8 @@ class NFDriverFileMP3Implementation : public NFDriver {
                                 NF_WILL_RENDER_CALLBACK will_render_callback,
                                 NF_DID_RENDER_CALLBACK did_render_callback,
                                 const char *output_destination,
-                                int bitrate);
+                                int bitrate,
+                                const NFDriverFileSettings &settings);
   ~NFDriverFileMP3Implementation();
 
  private:
@@ -53,11 +62,20 @@ class NFDriverFileMP3Implementation : public NFDriver {
   const NF_DID_RENDER_CALLBACK _did_render_callback;
   const std::string _output_destination;
   const int _bitrate;
+  const NFDriverFileSettings _settings;
+
+  NF_INPUT_CALLBACK _input_callback;
 
   std::shared_ptr<std::thread> _thread;
+  std::shared_ptr<NFDriverWorkerPool::Job> _job;
   std::atomic<bool> _run;
+  NFDriverDataWaiter _waiter;
+  std::unique_ptr<NFDriverFileMP3Encoder> _encoder;
 
   static void run(NFDriverFileMP3Implementation *driver);
+  bool begin();
+  bool renderBlock();  // Returns false after the last block of the input.
+  void end();
 };
 
 }  // namespace driver
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+
+namespace nativeformat {
+namespace driver {
+
+// Hands the latest timestamp of the audio thread to any other thread without
+// locks. It's a sequence lock: the sequence is odd while the audio thread
+// writes, and readers retry if it changed while they were reading.
+class NFDriverTimestampPublisher {
+ public:
+  NFDriverTimestampPublisher()
+      : _sequence(0),
+        _frames_rendered(0),
+        _frames_played(0),
+        _output_latency(0.0),
+        _timestamp(0.0),
+        _samplerate(0) {}
+
+  // Audio thread only.
+  void publish(const NFDriverTimestamp &timestamp) {
+    unsigned int sequence = _sequence.load(std::memory_order_relaxed);
+    _sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _frames_rendered.store(timestamp.framesRendered, std::memory_order_relaxed);
+    _frames_played.store(timestamp.framesPlayed, std::memory_order_relaxed);
+    _output_latency.store(timestamp.outputLatency, std::memory_order_relaxed);
+    _timestamp.store(timestamp.timestamp, std::memory_order_relaxed);
+    _samplerate.store(timestamp.samplerate, std::memory_order_relaxed);
+    _sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Any thread. Returns false if nothing was published yet.
+  bool read(NFDriverTimestamp *timestamp) const {
+    unsigned int before, after;
+    do {
+      before = _sequence.load(std::memory_order_acquire);
+      timestamp->framesRendered = _frames_rendered.load(std::memory_order_relaxed);
+      timestamp->framesPlayed = _frames_played.load(std::memory_order_relaxed);
+      timestamp->outputLatency = _output_latency.load(std::memory_order_relaxed);
+      timestamp->timestamp = _timestamp.load(std::memory_order_relaxed);
+      timestamp->samplerate = _samplerate.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = _sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || (before != after));
+    return before != 0;
+  }
+
+ private:
+  std::atomic<unsigned int> _sequence;
+  std::atomic<long long> _frames_rendered, _frames_played;
+  std::atomic<double> _output_latency, _timestamp;
+  std::atomic<int> _samplerate;
+};
+
+}  // namespace driver
+}  // namespace nativeformat
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include "NFDriverTrace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace nativeformat {
+namespace driver {
+
+thread_local NFDriverTrace *NFDriverTrace::_current = nullptr;
+
+static std::atomic<int> next_thread_id(1);
+
+NFDriverTrace::NFDriverTrace(const std::string &thread_name, int capacity)
+    : _thread_name(thread_name),
+      _thread_id(next_thread_id++),
+      _capacity(static_cast<uint64_t>(capacity > 0 ? capacity : 1)),
+      _events(new event[_capacity]),
+      _count(0) {}
+
+bool NFDriverTrace::write(const std::string &path) const {
+  // Copy the ring, then drop what the audio thread may have overwritten while
+  // copying: the slots of events older than the capacity by now, and the one
+  // being recorded.
+  const uint64_t last = _count.load(std::memory_order_acquire);
+  uint64_t first = (last > _capacity) ? last - _capacity : 0;
+  std::vector<const char *> names;
+  std::vector<uint64_t> times;
+  names.reserve(static_cast<size_t>(last - first));
+  times.reserve(static_cast<size_t>(last - first));
+  for (uint64_t n = first; n < last; n++) {
+    const event &slot = _events[n % _capacity];
+    names.push_back(slot.name.load(std::memory_order_relaxed));
+    times.push_back(slot.time.load(std::memory_order_relaxed));
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const uint64_t count = _count.load(std::memory_order_relaxed);
+  size_t skip = 0;
+  if (count + 1 > first + _capacity) {
+    skip = static_cast<size_t>(std::min(count + 1 - _capacity - first, last - first));
+  }
+
+  FILE *fhandle = fopen(path.c_str(), "wb");
+  if (fhandle == nullptr) {
+    return false;
+  }
+  fprintf(fhandle,
+          "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}",
+          _thread_id,
+          _thread_name.c_str());
+  // Complete events from the pairs of a begin and the end after it. An end
+  // without its begin (overwritten) and an unfinished begin are left out.
+  const char *begin_name = nullptr;
+  uint64_t begin_time = 0;
+  for (size_t n = skip; n < names.size(); n++) {
+    const bool is_end = (times[n] & endFlag) != 0;
+    const uint64_t time = times[n] & ~endFlag;
+    if (!is_end) {
+      begin_name = names[n];
+      begin_time = time;
+      continue;
+    }
+    if ((begin_name == nullptr) || (strcmp(begin_name, names[n]) != 0)) {
+      continue;
+    }
+    fprintf(fhandle,
+            ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            begin_name,
+            _thread_id,
+            static_cast<double>(begin_time) * 0.001,
+            static_cast<double>(time - begin_time) * 0.001);
+    begin_name = nullptr;
+  }
+  fprintf(fhandle, "\n]}\n");
+  return fclose(fhandle) == 0;
+}
+
+}  // namespace driver
+}  // namespace nativeformat
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace nativeformat {
+namespace driver {
+
+// Records when the steps of an audio thread begin and end, such as render or
+// snd_pcm_writei, into a ring of the last events. Recording is a clock read and
+// two relaxed stores, without locks, allocations or I/O, and nothing at all on
+// a thread without a trace. write() copies the ring while recording goes on,
+// and writes it as Chrome trace event JSON, for chrome://tracing or Perfetto.
+// Event names must be string literals, only the pointer is stored.
+class NFDriverTrace {
+ public:
+  NFDriverTrace(const std::string &thread_name, int capacity);
+
+  // Records the events of the calling thread into the trace, NULL for none.
+  static void attach(NFDriverTrace *trace) { _current = trace; }
+  static void begin(const char *name) {
+    if (_current) _current->record(name, 0);
+  }
+  static void end(const char *name) {
+    if (_current) _current->record(name, endFlag);
+  }
+
+  // Any thread. Returns false if the file couldn't be written.
+  bool write(const std::string &path) const;
+
+ private:
+  static const uint64_t endFlag = uint64_t(1) << 63;  // In the time of an end.
+  typedef struct event {
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> time;  // Nanoseconds of the steady clock.
+  } event;
+
+  static thread_local NFDriverTrace *_current;
+
+  const std::string _thread_name;
+  const int _thread_id;
+  const uint64_t _capacity;
+  std::unique_ptr<event[]> _events;
+  std::atomic<uint64_t> _count;  // Events recorded so far, the next slot.
+
+  static uint64_t nanoseconds() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+  }
+
+  void record(const char *name, uint64_t flag) {
+    const uint64_t time = nanoseconds() | flag, count = _count.load(std::memory_order_relaxed);
+    // Orders the previous count before the slot's new contents, so a reader
+    // seeing them also sees that the slot was taken over.
+    std::atomic_thread_fence(std::memory_order_release);
+    event &slot = _events[count % _capacity];
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.time.store(time, std::memory_order_relaxed);
+    _count.store(count + 1, std::memory_order_release);
+  }
+};
+
+}  // namespace driver
+}  // namespace nativeformat
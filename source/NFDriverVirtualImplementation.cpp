@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include "NFDriverVirtualImplementation.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace nativeformat {
+namespace driver {
+
+NFDriverVirtualImplementation::NFDriverVirtualImplementation(
+    void *clientdata,
+    NF_STUTTER_CALLBACK stutter_callback,
+    NF_RENDER_CALLBACK render_callback,
+    NF_ERROR_CALLBACK error_callback,
+    NF_WILL_RENDER_CALLBACK will_render_callback,
+    NF_DID_RENDER_CALLBACK did_render_callback,
+    const char *output_destination,
+    NFDriverVirtualDeviceSettings settings,
+    NFDriverAdapterSettings adapter_settings)
+    : _clientdata(clientdata),
+      _stutter_callback(stutter_callback),
+      _render_callback(render_callback),
+      _error_callback(error_callback),
+      _will_render_callback(will_render_callback),
+      _did_render_callback(did_render_callback),
+      _output_destination(output_destination ? output_destination : ""),
+      _settings(settings),
+      _adapter_settings(adapter_settings),
+      _will_render_timestamp_callback(nullptr),
+      _planar_render_callback(nullptr),
+      _samplerate_callback(nullptr),
+      _trace(adapter_settings.traceEvents
+                 ? new NFDriverTrace("NFDriver virtual device", adapter_settings.traceEvents)
+                 : nullptr),
+      _thread(nullptr),
+      _stopping(false),
+      _gain(1.0f),
+      _source_samplerate(0.0) {}
+
+NFDriverVirtualImplementation::~NFDriverVirtualImplementation() {
+  if (isPlaying()) {
+    setPlaying(false);
+  }
+}
+
+bool NFDriverVirtualImplementation::isPlaying() const {
+  return !!_thread;
+}
+
+bool NFDriverVirtualImplementation::getTimestamp(NFDriverTimestamp *timestamp) const {
+  return _timestamps.read(timestamp);
+}
+
+void NFDriverVirtualImplementation::setWillRenderTimestampCallback(
+    NF_WILL_RENDER_TIMESTAMP_CALLBACK callback) {
+  _will_render_timestamp_callback = callback;
+}
+
+bool NFDriverVirtualImplementation::setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback) {
+  _planar_render_callback = callback;
+  return true;
+}
+
+bool NFDriverVirtualImplementation::setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback) {
+  _samplerate_callback = callback;
+  return true;
+}
+
+bool NFDriverVirtualImplementation::writeTrace(const char *path) const {
+  return _trace && _trace->write(path);
+}
+
+bool NFDriverVirtualImplementation::setGain(float gain) {
+  _gain = gain;
+  return true;
+}
+
+bool NFDriverVirtualImplementation::setSourceSamplerate(double samplerate) {
+  _source_samplerate = samplerate;
+  return true;
+}
+
+void NFDriverVirtualImplementation::setPlaying(bool playing) {
+  if (isPlaying() == playing) {
+    return;
+  }
+
+  if (!playing) {
+    if (std::this_thread::get_id() != _thread->get_id()) {
+      // With fade_out the thread plays the fade and ends by itself.
+      if (_adapter_settings.fadeOut && _adapter_settings.gainRampMs > 0.0f) {
+        _stopping = true;
+      } else {
+        _run = false;
+      }
+      _thread->join();
+    }
+    _run = false;
+    _thread = nullptr;
+  } else {
+    _run = true;
+    _stopping = false;
+    _thread = std::make_shared<std::thread>(&NFDriverVirtualImplementation::run, this);
+  }
+}
+
+void NFDriverVirtualImplementation::run(NFDriverVirtualImplementation *driver) {
+  const NFDriverVirtualDeviceSettings &settings = driver->_settings;
+  NFDriverTrace::attach(driver->_trace.get());
+
+  // The "hardware" output is optionally recorded as raw interleaved floats.
+  FILE *fhandle = nullptr;
+  if (!driver->_output_destination.empty()) {
+    fhandle = fopen(driver->_output_destination.c_str(), "wb");
+    if (fhandle == nullptr) {
+      driver->_error_callback(driver->_clientdata, "Failed to create file.", 0);
+    }
+  }
+
+  NFDriverAdapter adapter(driver->_clientdata,
+                          driver->_stutter_callback,
+                          driver->_render_callback,
+                          driver->_error_callback,
+                          driver->_will_render_timestamp_callback
+                              ? nullptr
+                              : driver->_will_render_callback,
+                          driver->_did_render_callback,
+                          &driver->_adapter_settings);
+  adapter.setPlanarRenderCallback(driver->_planar_render_callback);
+  adapter.setSamplerateCallback(driver->_samplerate_callback);
+  adapter.setSamplerate(settings.samplerate);
+  adapter.fadeIn();
+
+  // std::minstd_rand is fully specified by the standard, unlike the
+  // distributions, so the jitter sequence is the same on every platform.
+  std::minstd_rand random(settings.seed ? settings.seed : 1);
+  std::vector<float> buffer(static_cast<size_t>(settings.periodSizeFrames * settings.numChannels));
+  bool buffer_is_silent = true;  // std::vector zeroes.
+  double source_samplerate = 0.0;
+
+  // Every period the device wakes the driver up at its nominal time plus some
+  // jitter. If the wakeup is later than the deadline, the hardware has already
+  // run out of audio: that's an xrun, like EPIPE from ALSA.
+  const double periodSeconds =
+      static_cast<double>(settings.periodSizeFrames) / static_cast<double>(settings.samplerate);
+  double xrunSeconds = 0.0;  // How long the device stood still after xruns.
+  for (int period = 0; driver->_run; period++) {
+    int jitter = 0;
+    if (settings.periodJitterMicroseconds > 0) {
+      jitter = static_cast<int>(random() % (settings.periodJitterMicroseconds + 1));
+    }
+
+    double wakeupTime = period * periodSeconds + xrunSeconds + jitter * 0.000001;
+    if (jitter > settings.deadlineMicroseconds) {
+      // The device stopped when it ran out of audio and restarts with this
+      // period, like after snd_pcm_prepare, so every following period is late
+      // by the overrun too.
+      xrunSeconds += (jitter - settings.deadlineMicroseconds) * 0.000001;
+      driver->_stutter_callback(driver->_clientdata);
+      driver->_error_callback(driver->_clientdata, "virtual device xrun", period);
+    }
+
+    // The device has two periods of buffer. At the nominal wakeup one period
+    // is still queued, and it drains while the wakeup is late.
+    NFDriverTimestamp timestamp;
+    long long queued = settings.periodSizeFrames -
+                       static_cast<long long>(jitter) * settings.samplerate / 1000000;
+    if ((period == 0) || (queued < 0)) queued = 0;
+    timestamp.framesRendered = static_cast<long long>(period) * settings.periodSizeFrames;
+    timestamp.framesPlayed = timestamp.framesRendered - queued;
+    timestamp.outputLatency = static_cast<double>(queued) / settings.samplerate;
+    timestamp.timestamp = wakeupTime;
+    timestamp.samplerate = settings.samplerate;
+    driver->_timestamps.publish(timestamp);
+    if (driver->_will_render_timestamp_callback) {
+      driver->_will_render_timestamp_callback(driver->_clientdata, &timestamp);
+    }
+
+    // Like the ALSA driver, silence is written into the buffer once only,
+    // except after a failed render, which may have written part of it.
+    bool silent = false;
+    const bool stopping = driver->_stopping;
+    adapter.setGain(stopping ? 0.0f : driver->_gain.load());
+    if (driver->_source_samplerate != source_samplerate) {
+      source_samplerate = driver->_source_samplerate;
+      adapter.setSourceSamplerate(source_samplerate);
+    }
+    if (!adapter.getFrames(buffer.data(),
+                           NULL,
+                           settings.periodSizeFrames,
+                           settings.numChannels,
+                           wakeupTime,
+                           &silent)) {
+      silent = true;
+      buffer_is_silent = false;
+    }
+    if (silent && !buffer_is_silent) {
+      memset(buffer.data(), 0, buffer.size() * sizeof(float));
+    }
+    buffer_is_silent = silent;
+
+    if (fhandle != nullptr) {
+      fwrite(buffer.data(), sizeof(float), buffer.size(), fhandle);
+    }
+
+    // Stopping ends with the fade out, or right away if the output is silent.
+    if (stopping && (silent || (adapter.getGain() == 0.0f))) {
+      break;
+    }
+  }
+
+  if (fhandle != nullptr) {
+    fclose(fhandle);
+  }
+  NFDriverTrace::attach(nullptr);
+}
+
+}  // namespace driver
+}  // namespace nativeformat
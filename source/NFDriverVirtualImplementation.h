@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "NFDriverAdapter.h"
+#include "NFDriverTimestampPublisher.h"
+#include "NFDriverTrace.h"
+
+namespace nativeformat {
+namespace driver {
+
+// The properties of the simulated sound card. Times are in microseconds of
+// virtual time.
+typedef struct NFDriverVirtualDeviceSettings {
+  int samplerate, periodSizeFrames, numChannels;
+  int periodJitterMicroseconds, deadlineMicroseconds;
+  unsigned int seed;
+} NFDriverVirtualDeviceSettings;
+
+// A sound card that only exists on a virtual clock. It asks the adapter for
+// audio exactly like the platform drivers do, but the period wakeups are
+// simulated, so the same settings and seed always produce the same sequence of
+// callbacks, xruns and stutters, as fast as the CPU allows.
+class NFDriverVirtualImplementation : public NFDriver {
+ public:
+  bool isPlaying() const;
+  void setPlaying(bool playing);
+  bool getTimestamp(NFDriverTimestamp *timestamp) const;
+  void setWillRenderTimestampCallback(NF_WILL_RENDER_TIMESTAMP_CALLBACK callback);
+  bool setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback);
+  bool setGain(float gain);
+  bool setSourceSamplerate(double samplerate);
+  bool setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback);
+  bool writeTrace(const char *path) const;
+
+  NFDriverVirtualImplementation(void *clientdata,
+                                NF_STUTTER_CALLBACK stutter_callback,
+                                NF_RENDER_CALLBACK render_callback,
+                                NF_ERROR_CALLBACK error_callback,
+                                NF_WILL_RENDER_CALLBACK will_render_callback,
+                                NF_DID_RENDER_CALLBACK did_render_callback,
+                                const char *output_destination,
+                                NFDriverVirtualDeviceSettings settings,
+                                NFDriverAdapterSettings adapter_settings);
+  ~NFDriverVirtualImplementation();
+
+ private:
+  void *_clientdata;
+  const NF_STUTTER_CALLBACK _stutter_callback;
+  const NF_RENDER_CALLBACK _render_callback;
+  const NF_ERROR_CALLBACK _error_callback;
+  const NF_WILL_RENDER_CALLBACK _will_render_callback;
+  const NF_DID_RENDER_CALLBACK _did_render_callback;
+  const std::string _output_destination;
+  const NFDriverVirtualDeviceSettings _settings;
+  const NFDriverAdapterSettings _adapter_settings;
+
+  NF_WILL_RENDER_TIMESTAMP_CALLBACK _will_render_timestamp_callback;
+  NF_PLANAR_RENDER_CALLBACK _planar_render_callback;
+  NF_SAMPLERATE_CALLBACK _samplerate_callback;
+  NFDriverTimestampPublisher _timestamps;
+  std::unique_ptr<NFDriverTrace> _trace;
+
+  std::shared_ptr<std::thread> _thread;
+  std::atomic<bool> _run;
+  std::atomic<bool> _stopping;  // Fading out, the thread ends by itself.
+  std::atomic<float> _gain;
+  std::atomic<double> _source_samplerate;
+
+  static void run(NFDriverVirtualImplementation *driver);
+};
+
+}  // namespace driver
+}  // namespace nativeformat
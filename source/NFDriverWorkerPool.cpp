@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include "NFDriverWorkerPool.h"
+
+namespace nativeformat {
+namespace driver {
+
+struct NFDriverWorkerPool::Job {
+  Step step;
+  std::mutex mutex;
+  std::condition_variable finished_condition;
+  bool finished;
+  // Under the pool's mutex.
+  bool waiting, woken;
+  WaitingJobs::iterator wait_position;
+};
+
+// The job whose step runs on this thread, to not wait for it in its own step.
+static thread_local NFDriverWorkerPool::Job *current_job = nullptr;
+
+NFDriverWorkerPool &NFDriverWorkerPool::shared() {
+  static NFDriverWorkerPool *pool =
+      new NFDriverWorkerPool(static_cast<int>(std::thread::hardware_concurrency()));
+  return *pool;
+}
+
+NFDriverWorkerPool::NFDriverWorkerPool(int num_workers)
+    : _queued_jobs(0), _num_waiting_jobs(0), _next_worker(0), _quit(false) {
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    _workers.emplace_back(new Worker);
+  }
+  for (size_t i = 0; i < _workers.size(); ++i) {
+    _workers[i]->thread = std::thread(&NFDriverWorkerPool::work, this, i);
+  }
+}
+
+NFDriverWorkerPool::~NFDriverWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _quit = true;
+  }
+  _wakeup.notify_all();
+  for (auto &worker : _workers) {
+    worker->thread.join();
+  }
+}
+
+std::shared_ptr<NFDriverWorkerPool::Job> NFDriverWorkerPool::start(Step step) {
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->step = step;
+  job->finished = job->waiting = job->woken = false;
+  // New jobs are spread over the workers, stealing evens out the rest.
+  push(*_workers[_next_worker++ % _workers.size()], job);
+  // A worker about to sleep checks the queues while holding the lock, so it
+  // either sees the job or is already waiting for the notification.
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+  }
+  _wakeup.notify_one();
+  return job;
+}
+
+void NFDriverWorkerPool::wait(const std::shared_ptr<Job> &job) {
+  if (job.get() == current_job) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->finished_condition.wait(lock, [&job] { return job->finished; });
+}
+
+void NFDriverWorkerPool::wake(const std::shared_ptr<Job> &job) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!job->waiting) {
+    job->woken = true;
+    return;
+  }
+  _waiting_jobs.erase(job->wait_position);
+  --_num_waiting_jobs;
+  job->waiting = false;
+  push(*_workers[_next_worker++ % _workers.size()], job);
+  _wakeup.notify_one();
+}
+
+void NFDriverWorkerPool::push(Worker &worker, const std::shared_ptr<Job> &job) {
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  worker.queue.push_back(job);
+  ++_queued_jobs;
+}
+
+// The front of the worker's own queue, or the back of another's.
+std::shared_ptr<NFDriverWorkerPool::Job> NFDriverWorkerPool::take(size_t index) {
+  std::shared_ptr<Job> job;
+  for (size_t i = 0; (i < _workers.size()) && !job; ++i) {
+    Worker &worker = *_workers[(index + i) % _workers.size()];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.queue.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      job = worker.queue.front();
+      worker.queue.pop_front();
+    } else {
+      job = worker.queue.back();
+      worker.queue.pop_back();
+    }
+    --_queued_jobs;
+  }
+  return job;
+}
+
+void NFDriverWorkerPool::pushWaitedJobs(size_t index) {
+  const Clock::time_point now = Clock::now();
+  while (!_waiting_jobs.empty() && (_waiting_jobs.begin()->first <= now)) {
+    std::shared_ptr<Job> job = _waiting_jobs.begin()->second;
+    _waiting_jobs.erase(_waiting_jobs.begin());
+    --_num_waiting_jobs;
+    job->waiting = false;
+    push(*_workers[index], job);
+  }
+}
+
+void NFDriverWorkerPool::work(size_t index) {
+  while (!_quit) {
+    if (_num_waiting_jobs > 0) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      pushWaitedJobs(index);
+    }
+    std::shared_ptr<Job> job = take(index);
+    if (!job) {
+      // Sleeps until a job is started or woken, or the first wait is over.
+      std::unique_lock<std::mutex> lock(_mutex);
+      pushWaitedJobs(index);
+      if (_quit) {
+        return;
+      }
+      if (_queued_jobs > 0) {
+        continue;
+      }
+      if (_waiting_jobs.empty()) {
+        _wakeup.wait(lock);
+      } else {
+        _wakeup.wait_until(lock, _waiting_jobs.begin()->first);
+      }
+      continue;
+    }
+
+    current_job = job.get();
+    const int wait_ms = job->step();
+    current_job = nullptr;
+    if (wait_ms == NF_DRIVER_WORKER_POOL_FINISHED) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->finished = true;
+      job->finished_condition.notify_all();
+    } else if (wait_ms < 1) {
+      push(*_workers[index], job);
+    } else {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (job->woken) {
+        job->woken = false;
+        push(*_workers[index], job);
+      } else {
+        job->waiting = true;
+        job->wait_position = _waiting_jobs.emplace(
+            Clock::now() + std::chrono::milliseconds(wait_ms), job);
+        ++_num_waiting_jobs;
+        // An idle worker may sleep until a later wait is over.
+        _wakeup.notify_one();
+      }
+    }
+  }
+}
+
+}  // namespace driver
+}  // namespace nativeformat
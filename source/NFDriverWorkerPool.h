@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// What a step returns when the job is finished.
+#define NF_DRIVER_WORKER_POOL_FINISHED -1
+
+namespace nativeformat {
+namespace driver {
+
+// Runs jobs made of short steps, such as rendering a block, on one thread per
+// CPU core. After every step the job goes to the back of its worker's queue,
+// so the jobs of a worker take turns, and a worker without jobs steals one
+// from the others. A job waiting for data steps aside until its wait is over or
+// it is woken.
+class NFDriverWorkerPool {
+ public:
+  // Returns how many milliseconds to wait before the next step, zero for none,
+  // or NF_DRIVER_WORKER_POOL_FINISHED.
+  typedef std::function<int()> Step;
+  struct Job;
+
+  // The pool shared by every driver, created on first use and never
+  // destroyed: at exit its workers may still run the steps of drivers nobody
+  // stopped, and joining them could hang. The process exit ends them.
+  static NFDriverWorkerPool &shared();
+
+  explicit NFDriverWorkerPool(int num_workers);
+  // Stops the workers after their current steps, the jobs left never finish.
+  ~NFDriverWorkerPool();
+
+  std::shared_ptr<Job> start(Step step);
+  // Blocks until a step of the job returned NF_DRIVER_WORKER_POOL_FINISHED.
+  // Returns right away in a step of the job itself.
+  void wait(const std::shared_ptr<Job> &job);
+  // Ends the wait of the job, or the next one if it isn't waiting.
+  void wake(const std::shared_ptr<Job> &job);
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::thread thread;
+  };
+
+  typedef std::chrono::steady_clock Clock;
+  typedef std::multimap<Clock::time_point, std::shared_ptr<Job>> WaitingJobs;
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::mutex _mutex;
+  std::condition_variable _wakeup;  // Idle workers sleep here.
+  WaitingJobs _waiting_jobs;       // By the end of their wait, under _mutex.
+  std::atomic<int> _queued_jobs, _num_waiting_jobs;
+  std::atomic<unsigned int> _next_worker;
+  std::atomic<bool> _quit;
+
+  void push(Worker &worker, const std::shared_ptr<Job> &job);
+  std::shared_ptr<Job> take(size_t index);
+  void pushWaitedJobs(size_t index);  // Under _mutex.
+  void work(size_t index);
+};
+
+}  // namespace driver
+}  // namespace nativeformat
@@ -282,7 +282,8 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                      NF_RENDER_CALLBACK render_callback,
                                      NF_ERROR_CALLBACK error_callback,
                                      NF_WILL_RENDER_CALLBACK will_render_callback,
-                                     NF_DID_RENDER_CALLBACK did_render_callback) {
+                                     NF_DID_RENDER_CALLBACK did_render_callback,
+                                     const NFSoundCardDriverSettings &settings) {
   internals = new NFSoundCardDriverInternals;
   memset(internals, 0, sizeof(NFSoundCardDriverInternals));
   internals->clientdata = clientdata;
@@ -301,7 +302,8 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                              internals->renderCallback,
                                              internals->errorCallback,
                                              internals->willRenderCallback,
-                                             internals->didRenderCallback);
+                                             internals->didRenderCallback,
+                                             &settings.adapter);
     internals->adapter->setSamplerate(openslesSamplerate);
   }
 }
@@ -20,7 +20,16 @@
  */
 #include <alsa/asoundlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <map>
+#include <string>
 #include "NFDriverAdapter.h"
+#include "NFDriverEventQueue.h"
+#include "NFDriverTimestampPublisher.h"
+#include "NFDriverTrace.h"
 
 namespace nativeformat {
 namespace driver {
@@ -29,20 +38,72 @@ typedef struct NFSoundCardDriverInternals {
   void *clientdata;
   NF_WILL_RENDER_CALLBACK willRenderCallback;
   NF_RENDER_CALLBACK renderCallback;
+  NF_PLANAR_RENDER_CALLBACK planarRenderCallback;
   NF_DID_RENDER_CALLBACK didRenderCallback;
   NF_STUTTER_CALLBACK stutterCallback;
   NF_ERROR_CALLBACK errorCallback;
-  int isPlaying, threadsRunning;  // Integers because of atomics.
+  // Errors of the audio thread go through here, the event queue with
+  // deferred_callbacks.
+  void *audioErrorClientdata;
+  NF_ERROR_CALLBACK audioErrorCallback;
+  NFDriverEventQueue *events;  // NULL without deferred_callbacks.
+  NFDriverTrace *trace;        // NULL without trace_events.
+  NF_WILL_RENDER_TIMESTAMP_CALLBACK willRenderTimestampCallback;
+  NF_SAMPLERATE_CALLBACK samplerateCallback;
+  NF_INPUT_CALLBACK inputCallback;
+  NFDriverTimestampPublisher timestamps;
+  NFSoundCardDriverSettings settings;
+  std::map<std::string, std::string> properties;
+  pthread_mutex_t propertiesMutex, threadMutex;
+  pthread_mutex_t stopMutex;  // With stopped, signalled when a fade out ended or
+  pthread_cond_t stopped;     // the audio thread exited.
+  pthread_t thread;
+  int wakeupFd;  // An eventfd waking the audio thread up to stop or resume.
+  int isPlaying, isShuttingDown, threadExited;  // Integers because of atomics.
+  int isStopping;                                // Fading out before stopping.
+  int microGain;                                 // The master gain in millionths.
+  int sourceMillihertz;                          // Zero for NF_DRIVER_SAMPLERATE.
+  bool hasThread;
 } NFSoundCardDriverInternals;
 
 typedef struct alsaPCMContext {
   float *buffer;
   snd_pcm_t *handle;
-  struct pollfd *pollDescriptors;
-  unsigned int outputSamplerate, periodSizeFrames, numChannels;
+  const char *deviceName;
+  struct pollfd *pollDescriptors;  // The device's, then one more for the wakeup fd.
+  unsigned int outputSamplerate, periodSizeFrames, bufferSizeFrames, numChannels;
+  unsigned int startThresholdFrames;
   int pollDescriptorsCount;
+  int queuedPeriods;  // Periods queued after writing one, see setQueuedPeriods.
+  int underruns;      // Since the last calibrateLatency.
+  int calibrationFramesLeft, maxLatenessFrames;
+  bool canPause;
+
+  // Full-duplex, NULL and zero for output only.
+  snd_pcm_t *captureHandle;
+  float *captureBuffer, *inputBuffer;  // The device's channels, then NF_DRIVER_CHANNELS.
+  unsigned int captureChannels;
 } alsaPCMContext;
 
+// Latency calibration keeps the whole buffer queued for the first seconds,
+// measuring how late each period is written. Then it keeps only as many
+// periods queued as twice the worst lateness needs, and adds one more for every
+// underrun after.
+#define CALIBRATION_SECONDS 2
+#define CALIBRATION_BUFFER_PERIODS 8
+
+// The hardware is opened through sysdefault. When it's gone, such as unplugged,
+// the fallback is ALSA's default device, which is usually a sound server
+// routing to what's still there. A device named by the output destination
+// falls back only when reconnecting: playing somewhere else from the start
+// would hide a typo.
+static const char *defaultDeviceNames[] = {"sysdefault", "default"};
+#define RECONNECT_INTERVAL_MS 500
+
+// How much longer than the gain ramp setPlaying(false) waits for the fade out
+// to play, before it stops anyway, such as when the device was lost.
+#define FADE_OUT_TIMEOUT_MS 1000
+
 // Called when the hardware audio driver has problems with I/O.
 static bool underrunRecovery(snd_pcm_t *handle,
                              int error,
@@ -65,14 +126,15 @@ static bool underrunRecovery(snd_pcm_t *handle,
 }
 
 // Waiting for a significant event, such as enough audio consumed by the
-// hardware audio driver.
+// hardware audio driver. Returns false without an error if woken up.
 static bool waitForPoll(alsaPCMContext *context,
                         bool *init,
                         void *clientdata,
                         NF_ERROR_CALLBACK errorCallback) {
   unsigned short revents;
   while (1) {
-    poll(context->pollDescriptors, context->pollDescriptorsCount, -1);
+    poll(context->pollDescriptors, context->pollDescriptorsCount + 1, -1);
+    if (context->pollDescriptors[context->pollDescriptorsCount].revents & POLLIN) return false;
     snd_pcm_poll_descriptors_revents(
         context->handle, context->pollDescriptors, context->pollDescriptorsCount, &revents);
 
@@ -87,6 +149,7 @@ static bool waitForPoll(alsaPCMContext *context,
           errorCallback(clientdata, "wait for poll write error", 0);
           return false;
         }
+        context->underruns++;
         *init = true;
       } else {
         errorCallback(clientdata, "wait for poll failed", 0);
@@ -97,13 +160,30 @@ static bool waitForPoll(alsaPCMContext *context,
   return true;
 }
 
-static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBACK errorCallback) {
+// Opens and sets up the device. When reconnecting, previous is the device
+// lost, and its samplerate, period and buffer size are asked for again.
+static bool setupALSA(alsaPCMContext *context,
+                      const NFSoundCardDriverSettings &settings,
+                      const alsaPCMContext *previous,
+                      void *clientdata,
+                      NF_ERROR_CALLBACK errorCallback) {
   memset(context, 0, sizeof(alsaPCMContext));
 
   snd_pcm_t *handle;
-  int error = snd_pcm_open(&handle, "sysdefault", SND_PCM_STREAM_PLAYBACK, 0);
+  const bool named = !settings.deviceName.empty();
+  const char *deviceNames[] = {named ? settings.deviceName.c_str() : defaultDeviceNames[0],
+                               defaultDeviceNames[1]};
+  size_t numDeviceNames = (named && !previous) ? 1 : sizeof(deviceNames) / sizeof(deviceNames[0]);
+  int error = -ENODEV;
+  for (size_t n = 0; (n < numDeviceNames) && (error < 0); n++) {
+    error = snd_pcm_open(&handle, deviceNames[n], SND_PCM_STREAM_PLAYBACK, 0);
+    context->deviceName = deviceNames[n];
+  }
   if (error < 0) {
-    errorCallback(clientdata, "snd_pcm_open error ", 0);
+    errorCallback(clientdata,
+                  (numDeviceNames == 1) ? "snd_pcm_open error, can't open the named device "
+                                        : "snd_pcm_open error ",
+                  error);
     return false;
   }
 
@@ -162,7 +242,7 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     return false;
   }
   // Set the hardware samplerate.
-  context->outputSamplerate = NF_DRIVER_SAMPLERATE;
+  context->outputSamplerate = previous ? previous->outputSamplerate : NF_DRIVER_SAMPLERATE;
   error = snd_pcm_hw_params_set_rate_near(handle, hwParams, &context->outputSamplerate, 0);
   if (error < 0) {
     errorCallback(clientdata, "snd_pcm_hw_params_set_rate_near error ", 0);
@@ -175,9 +255,9 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     snd_pcm_close(handle);
     return false;
   }
-  // Try to set an optimal buffer and period size for low latency.
-  // Buffer size = 2 * period size is the best (one period for playing, one
-  // period for the app filling with data.)
+  // Try to set an optimal buffer and period size for low latency, unless the
+  // options say otherwise. Buffer size = 2 * period size is the best (one
+  // period for playing, one period for the app filling with data.)
   snd_pcm_uframes_t bufferSizeFrames = 0;
   error = snd_pcm_hw_params_get_buffer_size_min(hwParams, &bufferSizeFrames);
   if (error < 0) {
@@ -186,10 +266,23 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     return false;
   }
   context->periodSizeFrames =
-      NFDriverAdapter::getOptimalNumberOfFrames((int)context->outputSamplerate);
-  div_t d = div((int)bufferSizeFrames, (int)context->periodSizeFrames);
-  if (d.quot < 2) d.quot = 2;
-  bufferSizeFrames = context->periodSizeFrames * d.quot;
+      (settings.periodSizeFrames > 0)
+          ? (unsigned int)settings.periodSizeFrames
+          : NFDriverAdapter::getOptimalNumberOfFrames((int)context->outputSamplerate,
+                                                      settings.adapter.blockFrames,
+                                                      settings.adapter.nativeRate);
+  int periodCount = settings.periodCount;
+  if (previous) {
+    context->periodSizeFrames = previous->periodSizeFrames;
+    periodCount = (int)(previous->bufferSizeFrames / previous->periodSizeFrames);
+  } else if (periodCount <= 0) {
+    periodCount = (int)bufferSizeFrames / (int)context->periodSizeFrames;
+    if (periodCount < 2) periodCount = 2;
+    // Calibration needs a deeper buffer to measure in.
+    if (settings.calibrateLatency && (periodCount < CALIBRATION_BUFFER_PERIODS))
+      periodCount = CALIBRATION_BUFFER_PERIODS;
+  }
+  bufferSizeFrames = context->periodSizeFrames * periodCount;
   error = snd_pcm_hw_params_set_buffer_size_near(handle, hwParams, &bufferSizeFrames);
   if (error < 0) {
     errorCallback(clientdata, "snd_pcm_hw_params_set_buffer_size_near error", 0);
@@ -217,6 +310,7 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     return false;
   }
   context->periodSizeFrames = (unsigned int)frames;
+  context->canPause = snd_pcm_hw_params_can_pause(hwParams) == 1;
   // Actually trying to set up the hardware (and its driver).
   error = snd_pcm_hw_params(handle, hwParams);
   if (error < 0) {
@@ -235,8 +329,12 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     snd_pcm_close(handle);
     return false;
   }
-  error = snd_pcm_sw_params_set_start_threshold(
-      handle, swParams, (bufferSizeFrames / context->periodSizeFrames) * context->periodSizeFrames);
+  context->startThresholdFrames =
+      (unsigned int)(bufferSizeFrames / context->periodSizeFrames) * context->periodSizeFrames;
+  if ((settings.startThresholdFrames > 0) &&
+      ((unsigned int)settings.startThresholdFrames < context->startThresholdFrames))
+    context->startThresholdFrames = (unsigned int)settings.startThresholdFrames;
+  error = snd_pcm_sw_params_set_start_threshold(handle, swParams, context->startThresholdFrames);
   if (error < 0) {
     errorCallback(clientdata, "snd_pcm_sw_params_set_start_threshold error ", 0);
     snd_pcm_close(handle);
@@ -248,6 +346,10 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     snd_pcm_close(handle);
     return false;
   }
+  // Hardware timestamps on the monotonic clock, for the playback position. Not
+  // fatal if the device can't, we fall back to snd_pcm_delay then.
+  snd_pcm_sw_params_set_tstamp_mode(handle, swParams, SND_PCM_TSTAMP_ENABLE);
+  snd_pcm_sw_params_set_tstamp_type(handle, swParams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
   error = snd_pcm_sw_params(handle, swParams);
   if (error < 0) {
     errorCallback(clientdata, "snd_pcm_sw_params error ", 0);
@@ -264,7 +366,7 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     return false;
   }
   struct pollfd *pollDescriptors =
-      (pollfd *)malloc(sizeof(struct pollfd) * context->pollDescriptorsCount);
+      (pollfd *)malloc(sizeof(struct pollfd) * (context->pollDescriptorsCount + 1));
   if (!pollDescriptors) {
     errorCallback(clientdata, "out of memory", 0);
     snd_pcm_close(handle);
@@ -277,6 +379,8 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
     free(pollDescriptors);
     return false;
   }
+  pollDescriptors[context->pollDescriptorsCount].fd = -1;  // Ignored by poll until set.
+  pollDescriptors[context->pollDescriptorsCount].events = POLLIN;
 
   // Allocate the buffer.
   // Why 8 for each sample? Because of exotic 64-bit audio formats.
@@ -290,151 +394,848 @@ static bool setupALSA(alsaPCMContext *context, void *clientdata, NF_ERROR_CALLBA
 
   context->handle = handle;
   context->pollDescriptors = pollDescriptors;
-  printf(
-      "  Buffer size: %i frames\n  Period size: %i frames\n  Sample rate: "
-      "%i Hz\n  Number of channels: %i\n",
-      (int)bufferSizeFrames,
-      context->periodSizeFrames,
-      context->outputSamplerate,
-      context->numChannels);
+  context->bufferSizeFrames = (unsigned int)bufferSizeFrames;
+  context->queuedPeriods = (int)(bufferSizeFrames / context->periodSizeFrames);
+  if (settings.calibrateLatency)
+    context->calibrationFramesLeft = CALIBRATION_SECONDS * (int)context->outputSamplerate;
   return true;
 }
 
-static void setAudioThreadPriority() {
-  // Set the thread priority. SCHED_FIFO may need CAP_SYS_NICE permission.
+// Sets up the capture device with the playback device's samplerate, period and
+// buffer size, and links the two, so they start, stop and run together. The
+// capture device never starts by itself, so reading can't start it before the
+// playback device's start threshold is reached.
+static bool setupCapture(alsaPCMContext *context,
+                         const char *deviceName,
+                         void *clientdata,
+                         NF_ERROR_CALLBACK errorCallback) {
+  snd_pcm_t *handle;
+  if (snd_pcm_open(&handle, deviceName, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK) < 0) {
+    errorCallback(clientdata, "capture snd_pcm_open error", 0);
+    return false;
+  }
+
+  snd_pcm_hw_params_t *hwParams;
+  snd_pcm_hw_params_alloca(&hwParams);
+  snd_pcm_sw_params_t *swParams;
+  snd_pcm_sw_params_alloca(&swParams);
+  unsigned int channels = NF_DRIVER_CHANNELS;
+  snd_pcm_uframes_t periodSizeFrames = context->periodSizeFrames,
+                    bufferSizeFrames = context->bufferSizeFrames, boundary;
+  const char *failure = NULL;
+  if (snd_pcm_hw_params_any(handle, hwParams) < 0)
+    failure = "capture snd_pcm_hw_params_any error";
+  else if (snd_pcm_hw_params_set_rate_resample(handle, hwParams, 0) < 0)
+    failure = "capture snd_pcm_hw_params_set_rate_resample error";
+  else if (snd_pcm_hw_params_set_access(handle, hwParams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+    failure = "capture snd_pcm_hw_params_set_access error";
+  else if (snd_pcm_hw_params_set_format(handle, hwParams, SND_PCM_FORMAT_FLOAT_LE) < 0)
+    failure = "capture snd_pcm_hw_params_set_format error";
+  else if (snd_pcm_hw_params_set_channels_near(handle, hwParams, &channels) < 0)
+    failure = "capture snd_pcm_hw_params_set_channels_near error";
+  else if (snd_pcm_hw_params_set_rate(handle, hwParams, context->outputSamplerate, 0) < 0)
+    failure = "capture device can't run at the playback samplerate";
+  else if (snd_pcm_hw_params_set_period_size_near(handle, hwParams, &periodSizeFrames, NULL) < 0)
+    failure = "capture snd_pcm_hw_params_set_period_size_near error";
+  else if (snd_pcm_hw_params_set_buffer_size_near(handle, hwParams, &bufferSizeFrames) < 0)
+    failure = "capture snd_pcm_hw_params_set_buffer_size_near error";
+  else if (snd_pcm_hw_params(handle, hwParams) < 0)
+    failure = "capture snd_pcm_hw_params error";
+  else if ((snd_pcm_sw_params_current(handle, swParams) < 0) ||
+           (snd_pcm_sw_params_get_boundary(swParams, &boundary) < 0) ||
+           (snd_pcm_sw_params_set_start_threshold(handle, swParams, boundary) < 0) ||
+           (snd_pcm_sw_params(handle, swParams) < 0))
+    failure = "capture snd_pcm_sw_params error";
+  else if (snd_pcm_link(context->handle, handle) < 0)
+    failure = "snd_pcm_link error";
+  if (failure) {
+    errorCallback(clientdata, failure, 0);
+    snd_pcm_close(handle);
+    return false;
+  }
+
+  context->captureBuffer =
+      (float *)malloc(context->periodSizeFrames * (channels + NF_DRIVER_CHANNELS) * sizeof(float));
+  if (!context->captureBuffer) {
+    errorCallback(clientdata, "out of memory", 0);
+    snd_pcm_close(handle);
+    return false;
+  }
+  context->inputBuffer = context->captureBuffer + context->periodSizeFrames * channels;
+  context->captureHandle = handle;
+  context->captureChannels = channels;
+  return true;
+}
+
+// Reads a period from the capture device, as many frames as written to the
+// playback device. Missing frames are silence, so the two stay aligned. Before
+// the playback device started, the capture device isn't running either, and
+// the period is silence without reading.
+static void capturePeriod(alsaPCMContext *context,
+                          bool started,
+                          NF_INPUT_CALLBACK inputCallback,
+                          void *clientdata,
+                          void *errorClientdata,
+                          NF_ERROR_CALLBACK errorCallback) {
+  NFDriverTrace::begin("capture");
+  int framesCaptured = 0, periodFrames = (int)context->periodSizeFrames;
+  while (started && (framesCaptured < periodFrames)) {
+    snd_pcm_sframes_t frames =
+        snd_pcm_readi(context->captureHandle,
+                      context->captureBuffer + framesCaptured * context->captureChannels,
+                      periodFrames - framesCaptured);
+    if (frames > 0) {
+      framesCaptured += (int)frames;
+      continue;
+    }
+    if ((frames == -EPIPE) || (frames == -ESTRPIPE)) {  // Overrun, restart capturing.
+      errorCallback(errorClientdata, "capture overrun", 0);
+      if (snd_pcm_prepare(context->captureHandle) == 0) snd_pcm_start(context->captureHandle);
+    }
+    break;  // -EAGAIN: not there yet.
+  }
+
+  const float *captured = context->captureBuffer;
+  float *input = context->inputBuffer;
+  for (int n = 0; n < framesCaptured; n++, captured += context->captureChannels) {
+    *input++ = captured[0];
+    *input++ = captured[(context->captureChannels > 1) ? 1 : 0];
+  }
+  memset(input, 0, (size_t)(periodFrames - framesCaptured) * NF_DRIVER_CHANNELS * sizeof(float));
+  inputCallback(clientdata, context->inputBuffer, periodFrames);
+  NFDriverTrace::end("capture");
+}
+
+// Where the output is at. The hardware timestamp belongs to the moment the
+// hardware pointer was last updated, and so does avail, so the frames still
+// queued are counted at that moment. Falls back to snd_pcm_delay and the
+// current time if the device has no timestamps.
+static bool measureTimestamp(alsaPCMContext *context,
+                             long long framesRendered,
+                             NFDriverTimestamp *timestamp) {
+  snd_pcm_uframes_t avail;
+  snd_htimestamp_t htstamp;
+  snd_pcm_sframes_t queued;
+  if ((snd_pcm_htimestamp(context->handle, &avail, &htstamp) == 0) &&
+      (htstamp.tv_sec || htstamp.tv_nsec))
+    queued = (snd_pcm_sframes_t)context->bufferSizeFrames - (snd_pcm_sframes_t)avail;
+  else {
+    if (snd_pcm_delay(context->handle, &queued) < 0) return false;
+    clock_gettime(CLOCK_MONOTONIC, &htstamp);
+  }
+  if (queued < 0) queued = 0;
+
+  timestamp->framesRendered = framesRendered;
+  timestamp->framesPlayed = framesRendered - queued;
+  if (timestamp->framesPlayed < 0) timestamp->framesPlayed = 0;
+  timestamp->outputLatency = (double)queued / (double)context->outputSamplerate;
+  timestamp->timestamp = (double)htstamp.tv_sec + (double)htstamp.tv_nsec * 0.000000001;
+  timestamp->samplerate = (int)context->outputSamplerate;
+  return true;
+}
+
+static void setProperty(NFSoundCardDriverInternals *internals,
+                        const std::string &key,
+                        const std::string &value) {
+  pthread_mutex_lock(&internals->propertiesMutex);
+  internals->properties[key] = value;
+  pthread_mutex_unlock(&internals->propertiesMutex);
+}
+
+// Reports what the device was set up with.
+static void setBufferProperties(NFSoundCardDriverInternals *internals, alsaPCMContext *context) {
+  setProperty(internals, NF_DRIVER_PERIOD_SIZE_KEY, std::to_string(context->periodSizeFrames));
+  setProperty(internals,
+              NF_DRIVER_PERIOD_COUNT_KEY,
+              std::to_string(context->bufferSizeFrames / context->periodSizeFrames));
+  setProperty(
+      internals, NF_DRIVER_START_THRESHOLD_KEY, std::to_string(context->startThresholdFrames));
+  setProperty(internals, "device", context->deviceName);
+  setProperty(internals, "buffer_size", std::to_string(context->bufferSizeFrames));
+  setProperty(internals, "samplerate", std::to_string(context->outputSamplerate));
+  setProperty(internals, "channels", std::to_string(context->numChannels));
+  setProperty(internals, "queued_periods", std::to_string(context->queuedPeriods));
+}
+
+// The poll wakes us up when one period less than this is queued, so writing a
+// period queues this many.
+static bool setQueuedPeriods(alsaPCMContext *context, int periods) {
+  snd_pcm_sw_params_t *swParams;
+  snd_pcm_sw_params_alloca(&swParams);
+  snd_pcm_uframes_t availMin =
+      context->bufferSizeFrames - (unsigned int)(periods - 1) * context->periodSizeFrames;
+  if ((snd_pcm_sw_params_current(context->handle, swParams) < 0) ||
+      (snd_pcm_sw_params_set_avail_min(context->handle, swParams, availMin) < 0) ||
+      (snd_pcm_sw_params(context->handle, swParams) < 0))
+    return false;
+  context->queuedPeriods = periods;
+  return true;
+}
+
+// Called before writing every period with calibrate_latency.
+static void calibrateLatency(NFSoundCardDriverInternals *internals,
+                             alsaPCMContext *context,
+                             bool running) {
+  int periodFrames = (int)context->periodSizeFrames,
+      bufferPeriods = (int)(context->bufferSizeFrames / context->periodSizeFrames);
+  int periods = context->queuedPeriods;
+
+  if (context->calibrationFramesLeft <= 0) {  // Calibrated, only underruns change it.
+    if (!context->underruns) return;
+    periods += context->underruns;
+    context->underruns = 0;
+  } else {
+    context->underruns = 0;
+    if (!running) return;
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(context->handle);
+    if (avail < 0) return;
+    // How much less is queued than the whole buffer minus the period played.
+    int latenessFrames =
+        (bufferPeriods - 1) * periodFrames - ((int)context->bufferSizeFrames - (int)avail);
+    if (latenessFrames > context->maxLatenessFrames) context->maxLatenessFrames = latenessFrames;
+    context->calibrationFramesLeft -= periodFrames;
+    if (context->calibrationFramesLeft > 0) return;
+    periods = 1 + (2 * context->maxLatenessFrames + periodFrames - 1) / periodFrames;
+  }
+
+  if (periods < 2) periods = 2;
+  if (periods > bufferPeriods) periods = bufferPeriods;
+  if ((periods != context->queuedPeriods) && setQueuedPeriods(context, periods))
+    setProperty(internals, "queued_periods", std::to_string(periods));
+}
+
+// glibc has no wrapper for sched_setattr, so SCHED_DEADLINE is set with the
+// system call directly.
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+typedef struct schedulingAttributes {
+  uint32_t size, policy;
+  uint64_t flags;
+  int32_t nice;
+  uint32_t priority;
+  uint64_t runtime, deadline, period;  // Nanoseconds.
+} schedulingAttributes;
+
+static bool setDeadlineScheduling(uint64_t runtimeNs, uint64_t periodNs) {
+#ifdef SYS_sched_setattr
+  schedulingAttributes attributes;
+  memset(&attributes, 0, sizeof(schedulingAttributes));
+  attributes.size = sizeof(schedulingAttributes);
+  attributes.policy = SCHED_DEADLINE;
+  attributes.runtime = runtimeNs;
+  attributes.deadline = attributes.period = periodNs;
+  return syscall(SYS_sched_setattr, 0, &attributes, 0) == 0;
+#else
+  return false;
+#endif
+}
+
+// Touch the stack we may use, so page faults will not happen later in the audio
+// processing.
+#define PREFAULT_STACK_BYTES (256 * 1024)
+static void prefaultStack() {
+  volatile unsigned char stack[PREFAULT_STACK_BYTES];
+  for (int n = 0; n < PREFAULT_STACK_BYTES; n += 4096) stack[n] = 0;
+  (void)stack;
+}
+
+static void setAudioThreadPriority(NFSoundCardDriverInternals *internals,
+                                   alsaPCMContext *context) {
+  const NFSoundCardDriverSettings &settings = internals->settings;
   pthread_t thread = pthread_self();
+
+  // Pin the thread to the requested CPUs.
+  cpu_set_t cpus;
+  if (settings.cpuAffinityMask) {
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64; cpu++) {
+      if (settings.cpuAffinityMask & (uint64_t(1) << cpu)) CPU_SET(cpu, &cpus);
+    }
+    int error = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+    if (error)
+      internals->audioErrorCallback(
+          internals->audioErrorClientdata, "pthread_setaffinity_np error", error);
+  }
+  if (pthread_getaffinity_np(thread, sizeof(cpu_set_t), &cpus) == 0) {
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpus)) continue;
+      if (!list.empty()) list += ",";
+      list += std::to_string(cpu);
+    }
+    setProperty(internals, NF_DRIVER_CPU_AFFINITY_KEY, list);
+  }
+
+  // Lock all current and future memory, then prefault the stack.
+  if (settings.lockMemory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+      prefaultStack();
+      setProperty(internals, NF_DRIVER_MLOCK_KEY, "1");
+    } else {
+      internals->audioErrorCallback(internals->audioErrorClientdata, "mlockall error", errno);
+      setProperty(internals, NF_DRIVER_MLOCK_KEY, "0");
+    }
+  }
+
+  // SCHED_DEADLINE gets the CPU for the runtime in every ALSA period. It needs
+  // CAP_SYS_NICE and an affinity covering the whole root domain, otherwise we
+  // fall back to SCHED_FIFO.
+  if (settings.schedulingPolicy == NFSoundCardSchedulingPolicyDeadline) {
+    uint64_t periodNs = (uint64_t)context->periodSizeFrames * 1000000000ULL /
+                        (uint64_t)context->outputSamplerate;
+    uint64_t runtimeNs = periodNs * (uint64_t)settings.deadlineRuntimePercent / 100;
+    if (setDeadlineScheduling(runtimeNs, periodNs)) {
+      setProperty(internals, NF_DRIVER_SCHED_POLICY_KEY, "deadline");
+      setProperty(internals, NF_DRIVER_SCHED_RUNTIME_KEY, std::to_string(runtimeNs / 1000));
+      setProperty(internals, "sched_period_us", std::to_string(periodNs / 1000));
+      return;
+    }
+    internals->audioErrorCallback(
+        internals->audioErrorClientdata, "sched_setattr SCHED_DEADLINE error", errno);
+  }
+
+  // Set the thread priority. SCHED_FIFO may need CAP_SYS_NICE permission.
   struct sched_param schedparam;
-  schedparam.sched_priority = sched_get_priority_max(SCHED_FIFO);
-  schedparam.sched_priority -= (schedparam.sched_priority / 10);  // 90% of the maximum priority.
-  pthread_setschedparam(thread, SCHED_FIFO, &schedparam);
+  if (settings.schedulingPolicy != NFSoundCardSchedulingPolicyOther) {
+    int maxPriority = sched_get_priority_max(SCHED_FIFO),
+        minPriority = sched_get_priority_min(SCHED_FIFO);
+    schedparam.sched_priority = settings.schedulingPriority;
+    if (schedparam.sched_priority <= 0)
+      schedparam.sched_priority = maxPriority - (maxPriority / 10);  // 90% of the maximum.
+    if (schedparam.sched_priority > maxPriority) schedparam.sched_priority = maxPriority;
+    if (schedparam.sched_priority < minPriority) schedparam.sched_priority = minPriority;
+    pthread_setschedparam(thread, SCHED_FIFO, &schedparam);
+  }
 
   int actualPolicy = 0;
   pthread_getschedparam(thread, &actualPolicy, &schedparam);
-  if (actualPolicy == SCHED_FIFO)
-    printf("Running with SCHED_FIFO and priority level %i.\n", schedparam.sched_priority);
-  else {
-    printf(
-        "Running with SCHED_OTHER priority. Audio dropouts may happen.\nRun "
-        "with CAP_SYS_NICE permission for proper scheduling.\n");
+  if (actualPolicy != SCHED_FIFO) {
+    // Audio dropouts may happen. Run with CAP_SYS_NICE permission for proper
+    // scheduling.
     schedparam.sched_priority = sched_get_priority_max(SCHED_OTHER);
     pthread_setschedparam(thread, SCHED_OTHER, &schedparam);
   }
+  setProperty(internals, NF_DRIVER_SCHED_POLICY_KEY, actualPolicy == SCHED_FIFO ? "fifo" : "other");
+  setProperty(internals, NF_DRIVER_SCHED_PRIORITY_KEY, std::to_string(schedparam.sched_priority));
+}
+
+static void consumeWakeups(int wakeupFd) {
+  uint64_t value;
+  while (read(wakeupFd, &value, sizeof(uint64_t)) > 0) {
+  }
+}
+
+// After waitForPoll returned false: true if the audio thread was woken up (to
+// stop, pause or resume), false on device errors.
+static bool wasWokenUp(alsaPCMContext *context, int wakeupFd) {
+  if (!(context->pollDescriptors[context->pollDescriptorsCount].revents & POLLIN)) return false;
+  consumeWakeups(wakeupFd);
+  return true;
+}
+
+// Warm device mode: stops the output but keeps the device configured. The
+// frames still queued are discarded when the device can't pause, so they are
+// not counted as rendered.
+static bool pauseDevice(alsaPCMContext *context, long long *framesRendered) {
+  if (context->canPause && (snd_pcm_state(context->handle) == SND_PCM_STATE_RUNNING) &&
+      (snd_pcm_pause(context->handle, 1) == 0))
+    return true;
+  snd_pcm_sframes_t delay = 0;
+  if ((snd_pcm_delay(context->handle, &delay) == 0) && (delay > 0)) *framesRendered -= delay;
+  snd_pcm_drop(context->handle);
+  return false;
+}
+
+// Warm device mode: restarts the output after pauseDevice. Returns true if the
+// buffer needs to be filled up again before the device starts.
+static bool resumeDevice(alsaPCMContext *context,
+                         bool paused,
+                         void *clientdata,
+                         NF_ERROR_CALLBACK errorCallback) {
+  if (paused && (snd_pcm_pause(context->handle, 0) == 0)) return false;
+  if (paused) snd_pcm_drop(context->handle);
+  if (snd_pcm_prepare(context->handle) < 0)
+    errorCallback(clientdata, "resume snd_pcm_prepare error", 0);
+  return true;
+}
+
+// Warm device mode: sleeps until setPlaying(true) or the destructor. Returns
+// false when shutting down.
+static bool waitForResume(NFSoundCardDriverInternals *internals) {
+  struct pollfd wakeup;
+  wakeup.fd = internals->wakeupFd;
+  wakeup.events = POLLIN;
+  while (1) {
+    consumeWakeups(internals->wakeupFd);
+    if (__sync_fetch_and_add(&internals->isShuttingDown, 0)) return false;
+    if (__sync_fetch_and_add(&internals->isPlaying, 0)) return true;
+    poll(&wakeup, 1, -1);
+  }
+}
+
+static void ignoreError(void *clientdata, const char *errorMessage, int errorCode) {}
+
+// Sets up the playback device, and the capture device for full-duplex.
+static bool openDevices(NFSoundCardDriverInternals *internals,
+                        alsaPCMContext *context,
+                        const alsaPCMContext *previous,
+                        NF_ERROR_CALLBACK errorCallback) {
+  if (!setupALSA(
+          context, internals->settings, previous, internals->audioErrorClientdata, errorCallback))
+    return false;
+  context->pollDescriptors[context->pollDescriptorsCount].fd = internals->wakeupFd;
+  const char *captureDeviceName = internals->settings.captureDeviceName.empty()
+                                      ? context->deviceName
+                                      : internals->settings.captureDeviceName.c_str();
+  if (internals->inputCallback &&
+      setupCapture(context, captureDeviceName, internals->audioErrorClientdata, errorCallback))
+    setProperty(internals, NF_DRIVER_CAPTURE_DEVICE_KEY, captureDeviceName);
+  setBufferProperties(internals, context);
+  return true;
+}
+
+// Dropping instead of draining: stopping should be immediate.
+static void closeDevices(alsaPCMContext *context) {
+  if (context->captureHandle) {
+    snd_pcm_unlink(context->captureHandle);
+    snd_pcm_drop(context->captureHandle);
+    snd_pcm_close(context->captureHandle);
+  }
+  if (context->handle) {
+    snd_pcm_drop(context->handle);
+    snd_pcm_close(context->handle);
+  }
+  free(context->pollDescriptors);
+  free(context->buffer);
+  free(context->captureBuffer);
+  memset(context, 0, sizeof(alsaPCMContext));
+}
+
+// Reopens the device, or the fallback, after it was lost. The adapter keeps
+// what it buffered, so playback continues right where it stopped. Returns
+// false if stopped before a device came back.
+static bool reconnectDevice(NFSoundCardDriverInternals *internals,
+                            alsaPCMContext *context,
+                            NFDriverAdapter *adapter) {
+  internals->audioErrorCallback(internals->audioErrorClientdata, "device lost, reconnecting", 0);
+  alsaPCMContext previous = *context;
+  closeDevices(context);
+
+  struct pollfd wakeup;
+  wakeup.fd = internals->wakeupFd;
+  wakeup.events = POLLIN;
+  NF_ERROR_CALLBACK errorCallback = internals->audioErrorCallback;
+  while (__sync_fetch_and_add(&internals->isPlaying, 0) &&
+         !__sync_fetch_and_add(&internals->isShuttingDown, 0)) {
+    if (openDevices(internals, context, &previous, errorCallback)) {
+      if (context->outputSamplerate != previous.outputSamplerate)
+        adapter->setSamplerate((int)context->outputSamplerate);
+      return true;
+    }
+    errorCallback = ignoreError;  // Report the first failure only.
+    poll(&wakeup, 1, RECONNECT_INTERVAL_MS);
+    consumeWakeups(internals->wakeupFd);
+  }
+  __sync_fetch_and_and(&internals->isPlaying, 0);
+  return false;
+}
+
+static bool tracedWaitForPoll(NFSoundCardDriverInternals *internals,
+                              alsaPCMContext *context,
+                              bool *init) {
+  NFDriverTrace::begin("poll");
+  bool result =
+      waitForPoll(context, init, internals->audioErrorClientdata, internals->audioErrorCallback);
+  NFDriverTrace::end("poll");
+  return result;
+}
+
+// Wakes up setPlaying(false) waiting for the fade out. The flag it waits for
+// is set before.
+static void signalStopped(NFSoundCardDriverInternals *internals) {
+  pthread_mutex_lock(&internals->stopMutex);
+  pthread_cond_signal(&internals->stopped);
+  pthread_mutex_unlock(&internals->stopMutex);
+}
+
+// Stopping fades out only with the fade_out option and a gain ramp.
+static bool fadesOut(const NFSoundCardDriverInternals *internals) {
+  return internals->settings.adapter.fadeOut && (internals->settings.adapter.gainRampMs > 0.0f);
 }
 
 // The actual audio rendering thread.
 static void *playbackThread(void *param) {
   NFSoundCardDriverInternals *internals = (NFSoundCardDriverInternals *)param;
-  while (__sync_fetch_and_add(&internals->threadsRunning, 0) > 1)
-    usleep(10000);  // Wait until another audio rendering thread is still running.
   alsaPCMContext context;
+  NFDriverTrace::attach(internals->trace);
 
-  if (setupALSA(&context, internals->clientdata, internals->errorCallback)) {
+  if (openDevices(internals, &context, NULL, internals->audioErrorCallback)) {
     NFDriverAdapter *adapter = new NFDriverAdapter(internals->clientdata,
                                                    internals->stutterCallback,
                                                    internals->renderCallback,
                                                    internals->errorCallback,
-                                                   internals->willRenderCallback,
-                                                   internals->didRenderCallback);
+                                                   internals->willRenderTimestampCallback
+                                                       ? NULL
+                                                       : internals->willRenderCallback,
+                                                   internals->didRenderCallback,
+                                                   &internals->settings.adapter);
+    adapter->setPlanarRenderCallback(internals->planarRenderCallback);
+    adapter->setSamplerateCallback(internals->samplerateCallback);
     adapter->setSamplerate((int)context.outputSamplerate);
-    setAudioThreadPriority();
+    if (internals->events)
+      adapter->setStutterCallback(NFDriverEventQueue::stutter, internals->events);
+    adapter->fadeIn();
+    setAudioThreadPriority(internals, &context);
 
-    bool init = true;
+    bool init = true, bufferIsSilent = false;
+    long long framesRendered = 0;
+    int sourceMillihertz = 0;
+    int playoutFrames = -1;  // Silence to write after a fade out, to stop.
+    NFDriverTimestamp timestamp;
     // "Infinite loop".
-    while (internals->isPlaying) {
-      // Wait until we can push more data.
-      if (!init && !waitForPoll(&context, &init, internals->clientdata, internals->errorCallback))
-        break;
+    while (1) {
+      if (!internals->isPlaying) {
+        // Warm device mode keeps everything alive while paused, so resuming is
+        // only a wakeup and an snd_pcm_pause.
+        if (!internals->settings.warmDevice) break;
+        bool paused = pauseDevice(&context, &framesRendered);
+        if (!waitForResume(internals)) break;
+        if (resumeDevice(&context,
+                         paused,
+                         internals->audioErrorClientdata,
+                         internals->audioErrorCallback))
+          init = true;
+        adapter->fadeIn();
+        continue;
+      }
+
+      // Stopping fades out first, then plays silence until the faded frames
+      // have left the device's buffer, so dropping or pausing it doesn't cut
+      // them off.
+      bool stopping = __sync_fetch_and_add(&internals->isStopping, 0) != 0;
+      if (!stopping) playoutFrames = -1;
+      if (playoutFrames == 0) {
+        __sync_fetch_and_and(&internals->isPlaying, 0);
+        __sync_fetch_and_and(&internals->isStopping, 0);
+        signalStopped(internals);
+        continue;
+      }
+
+      // Wait until we can push more data. The loop top handles the wakeups.
+      if (!init && !tracedWaitForPoll(internals, &context, &init)) {
+        if (wasWokenUp(&context, internals->wakeupFd)) continue;
+        if (!reconnectDevice(internals, &context, adapter)) break;
+        init = true;
+        bufferIsSilent = false;
+        continue;
+      }
+
+      // Full-duplex: the input of this period first, so it can be processed
+      // into the output.
+      if (context.captureHandle)
+        capturePeriod(&context,
+                      !init,
+                      internals->inputCallback,
+                      internals->clientdata,
+                      internals->audioErrorClientdata,
+                      internals->audioErrorCallback);
+
+      // Publish where the output is at, before the next buffer is rendered.
+      if (measureTimestamp(&context, framesRendered, &timestamp))
+        internals->timestamps.publish(timestamp);
+      else
+        internals->timestamps.read(&timestamp);
+      if (internals->willRenderTimestampCallback)
+        internals->willRenderTimestampCallback(internals->clientdata, &timestamp);
 
-      // Get the next buffer from the audio provider (the player).
-      if (!adapter->getFrames(context.buffer, NULL, context.periodSizeFrames, context.numChannels))
+      // Get the next buffer from the audio provider (the player). Silence is
+      // written into the buffer once only, except after a failed render, which
+      // may have written part of the buffer.
+      bool silent = false;
+      adapter->setGain(stopping ? 0.0f
+                                : __sync_fetch_and_add(&internals->microGain, 0) * 0.000001f);
+      if (internals->sourceMillihertz != sourceMillihertz) {
+        sourceMillihertz = __sync_fetch_and_add(&internals->sourceMillihertz, 0);
+        adapter->setSourceSamplerate(sourceMillihertz * 0.001);
+      }
+      if (playoutFrames > 0) {
+        silent = true;
+        playoutFrames -= context.periodSizeFrames;
+        if (playoutFrames < 0) playoutFrames = 0;
+      } else if (!adapter->getFrames(context.buffer,
+                                     NULL,
+                                     context.periodSizeFrames,
+                                     context.numChannels,
+                                     -1.0,
+                                     &silent)) {
+        silent = true;
+        bufferIsSilent = false;
+      }
+      // A silent period ends the fade out early.
+      if (stopping && (playoutFrames < 0) && (silent || (adapter->getGain() == 0.0f)))
+        playoutFrames = (int)context.bufferSizeFrames;
+      if (silent && !bufferIsSilent)
         memset(context.buffer, 0, context.periodSizeFrames * context.numChannels * sizeof(float));
+      bufferIsSilent = silent;
+      if (internals->settings.calibrateLatency) calibrateLatency(internals, &context, !init);
 
       // Write the data.
       float *buffer = context.buffer;
       int framesLeft = context.periodSizeFrames;
       snd_pcm_sframes_t framesWritten;
+      bool deviceLost = false;
 
       while (framesLeft > 0) {
+        NFDriverTrace::begin("snd_pcm_writei");
         framesWritten = snd_pcm_writei(context.handle, buffer, framesLeft);
+        NFDriverTrace::end("snd_pcm_writei");
 
         if (framesWritten < 0) {
-          if (!underrunRecovery(
-                  context.handle, framesWritten, internals->clientdata, internals->errorCallback)) {
-            internals->errorCallback(
-                internals->clientdata, "underrun recovery write error", framesWritten);
-            __sync_fetch_and_and(&internals->isPlaying, 0);
+          if (!underrunRecovery(context.handle,
+                                framesWritten,
+                                internals->audioErrorClientdata,
+                                internals->audioErrorCallback)) {
+            internals->audioErrorCallback(internals->audioErrorClientdata,
+                                          "underrun recovery write error",
+                                          framesWritten);
+            deviceLost = true;
             break;
           }
           init = true;
-          internals->errorCallback(internals->clientdata, "skip one period", 0);
+          context.underruns++;
+          internals->audioErrorCallback(internals->audioErrorClientdata, "skip one period", 0);
           break;
         }
 
         if (snd_pcm_state(context.handle) == SND_PCM_STATE_RUNNING) init = false;
+        framesRendered += framesWritten;
         buffer += framesWritten * context.numChannels;
         framesLeft -= framesWritten;
         if (framesLeft <= 0) break;
 
-        if (!waitForPoll(&context, &init, internals->clientdata, internals->errorCallback)) {
-          __sync_fetch_and_and(&internals->isPlaying, 0);
+        if (!tracedWaitForPoll(internals, &context, &init)) {
+          deviceLost = !wasWokenUp(&context, internals->wakeupFd);
           break;
         }
       }
+
+      if (deviceLost) {
+        if (!reconnectDevice(internals, &context, adapter)) break;
+        init = true;
+        bufferIsSilent = false;
+      }
     }
 
     delete adapter;
-    snd_pcm_drain(context.handle);
-    snd_pcm_close(context.handle);
-    free(context.pollDescriptors);
-    free(context.buffer);
-  }
+    closeDevices(&context);
+  } else
+    __sync_fetch_and_and(&internals->isPlaying, 0);  // Nothing to play on.
 
-  __sync_fetch_and_add(&internals->threadsRunning, -1);
-  pthread_detach(pthread_self());
-  pthread_exit(NULL);
+  NFDriverTrace::attach(NULL);
+  __sync_fetch_and_or(&internals->threadExited, 1);
+  signalStopped(internals);
   return NULL;
 }
 
+// Stops the audio thread and waits for it to exit. Call with threadMutex
+// locked, never from the audio thread.
+static void wakeUpPlaybackThread(NFSoundCardDriverInternals *internals) {
+  uint64_t one = 1;
+  if (write(internals->wakeupFd, &one, sizeof(uint64_t)) < 0)
+    internals->errorCallback(internals->clientdata, "eventfd write error", errno);
+}
+
+// Fades the output out and waits until the audio thread signals that it
+// stopped playing. Call with threadMutex locked, never from the audio thread.
+static void fadeOutPlaybackThread(NFSoundCardDriverInternals *internals) {
+  if (!fadesOut(internals) || !internals->hasThread) return;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  long long timeoutMs = (long long)internals->settings.adapter.gainRampMs + FADE_OUT_TIMEOUT_MS;
+  deadline.tv_sec += (time_t)(timeoutMs / 1000);
+  deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&internals->stopMutex);
+  __sync_fetch_and_or(&internals->isStopping, 1);
+  while (__sync_fetch_and_add(&internals->isPlaying, 0) &&
+         !__sync_fetch_and_add(&internals->threadExited, 0))
+    if (pthread_cond_timedwait(&internals->stopped, &internals->stopMutex, &deadline) ==
+        ETIMEDOUT)
+      break;
+  __sync_fetch_and_and(&internals->isStopping, 0);
+  pthread_mutex_unlock(&internals->stopMutex);
+}
+
+static void joinPlaybackThread(NFSoundCardDriverInternals *internals) {
+  __sync_fetch_and_and(&internals->isPlaying, 0);
+  if (!internals->hasThread) return;
+  __sync_fetch_and_or(&internals->isShuttingDown, 1);
+  wakeUpPlaybackThread(internals);
+  pthread_join(internals->thread, NULL);
+  internals->hasThread = false;
+  internals->isShuttingDown = internals->threadExited = internals->isStopping = 0;
+  consumeWakeups(internals->wakeupFd);  // So the next audio thread will not stop immediately.
+}
+
 NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                      NF_STUTTER_CALLBACK stutter_callback,
                                      NF_RENDER_CALLBACK render_callback,
                                      NF_ERROR_CALLBACK error_callback,
                                      NF_WILL_RENDER_CALLBACK will_render_callback,
-                                     NF_DID_RENDER_CALLBACK did_render_callback) {
+                                     NF_DID_RENDER_CALLBACK did_render_callback,
+                                     const NFSoundCardDriverSettings &settings) {
   internals = new NFSoundCardDriverInternals;
   internals->clientdata = clientdata;
-  internals->isPlaying = internals->threadsRunning = 0;
+  internals->isPlaying = internals->isShuttingDown = internals->threadExited =
+      internals->isStopping = 0;
+  internals->hasThread = false;
+  internals->microGain = 1000000;
+  internals->sourceMillihertz = 0;
   internals->stutterCallback = stutter_callback;
   internals->renderCallback = render_callback;
+  internals->planarRenderCallback = NULL;
   internals->willRenderCallback = will_render_callback;
   internals->didRenderCallback = did_render_callback;
   internals->errorCallback = error_callback;
+  if (settings.deferCallbacks) {
+    internals->events = new NFDriverEventQueue(clientdata, stutter_callback, error_callback);
+    internals->audioErrorClientdata = internals->events;
+    internals->audioErrorCallback = NFDriverEventQueue::error;
+  } else {
+    internals->events = NULL;
+    internals->audioErrorClientdata = clientdata;
+    internals->audioErrorCallback = error_callback;
+  }
+  internals->willRenderTimestampCallback = NULL;
+  internals->samplerateCallback = NULL;
+  internals->inputCallback = NULL;
+  internals->settings = settings;
+  internals->trace = settings.adapter.traceEvents
+                         ? new NFDriverTrace("NFDriver ALSA", settings.adapter.traceEvents)
+                         : NULL;
+  pthread_mutex_init(&internals->propertiesMutex, NULL);
+  pthread_mutex_init(&internals->threadMutex, NULL);
+  pthread_mutex_init(&internals->stopMutex, NULL);
+  pthread_condattr_t stoppedAttributes;
+  pthread_condattr_init(&stoppedAttributes);
+  pthread_condattr_setclock(&stoppedAttributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&internals->stopped, &stoppedAttributes);
+  pthread_condattr_destroy(&stoppedAttributes);
+  internals->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (internals->wakeupFd < 0) error_callback(clientdata, "eventfd error", errno);
 }
 
 NFSoundCardDriver::~NFSoundCardDriver() {
-  __sync_fetch_and_and(&internals->isPlaying,
-                       0);  // Notify the audio rendering threads to stop with isPlaying to 0.
-  while (__sync_fetch_and_add(&internals->threadsRunning, 0) > 0)
-    usleep(10000);  // Wait until any audio rendering thread is running.
+  pthread_mutex_lock(&internals->threadMutex);
+  fadeOutPlaybackThread(internals);
+  joinPlaybackThread(internals);
+  pthread_mutex_unlock(&internals->threadMutex);
+  delete internals->events;  // After the audio thread, dispatching what it left.
+  delete internals->trace;
+  if (internals->wakeupFd >= 0) close(internals->wakeupFd);
+  pthread_mutex_destroy(&internals->threadMutex);
+  pthread_mutex_destroy(&internals->propertiesMutex);
+  pthread_cond_destroy(&internals->stopped);
+  pthread_mutex_destroy(&internals->stopMutex);
   delete internals;
 }
 
+std::map<std::string, std::string> NFSoundCardDriver::getProperties() const {
+  pthread_mutex_lock(&internals->propertiesMutex);
+  std::map<std::string, std::string> properties = internals->properties;
+  pthread_mutex_unlock(&internals->propertiesMutex);
+  return properties;
+}
+
+bool NFSoundCardDriver::getTimestamp(NFDriverTimestamp *timestamp) const {
+  return internals->timestamps.read(timestamp);
+}
+
+void NFSoundCardDriver::setWillRenderTimestampCallback(NF_WILL_RENDER_TIMESTAMP_CALLBACK callback) {
+  internals->willRenderTimestampCallback = callback;
+}
+
+bool NFSoundCardDriver::setPlanarRenderCallback(NF_PLANAR_RENDER_CALLBACK callback) {
+  internals->planarRenderCallback = callback;
+  return true;
+}
+
+bool NFSoundCardDriver::setSamplerateCallback(NF_SAMPLERATE_CALLBACK callback) {
+  internals->samplerateCallback = callback;
+  return true;
+}
+
+bool NFSoundCardDriver::setInputCallback(NF_INPUT_CALLBACK callback) {
+  internals->inputCallback = callback;
+  return true;
+}
+
+bool NFSoundCardDriver::writeTrace(const char *path) const {
+  return internals->trace && internals->trace->write(path);
+}
+
+bool NFSoundCardDriver::setGain(float gain) {
+  __sync_lock_test_and_set(&internals->microGain, static_cast<int>(gain * 1000000.0f + 0.5f));
+  return true;
+}
+
+bool NFSoundCardDriver::setSourceSamplerate(double samplerate) {
+  __sync_lock_test_and_set(&internals->sourceMillihertz,
+                           static_cast<int>(samplerate * 1000.0 + 0.5));
+  return true;
+}
+
 bool NFSoundCardDriver::isPlaying() const {
   return __sync_fetch_and_add(&internals->isPlaying, 0) > 0;
 }
 
 void NFSoundCardDriver::setPlaying(bool playing) {
-  if (playing) {
-    if (__sync_bool_compare_and_swap(&internals->isPlaying,
-                                     0,
-                                     1)) {  // If we actually flip isPlaying from 0 to 1.
-      __sync_fetch_and_add(&internals->threadsRunning, 1);
-      pthread_t thread;
-      pthread_create(&thread, NULL, playbackThread, internals);
+  // The audio thread can't join itself. Stopping from a callback just notifies
+  // the loop, which fades out first with fade_out. The thread is joined by the
+  // next setPlaying(true) or the destructor.
+  if (internals->hasThread && pthread_equal(pthread_self(), internals->thread)) {
+    if (playing)
+      __sync_fetch_and_and(&internals->isStopping, 0);
+    else if (fadesOut(internals))
+      __sync_fetch_and_or(&internals->isStopping, 1);
+    else
+      __sync_fetch_and_and(&internals->isPlaying, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&internals->threadMutex);
+  if (playing)
+    __sync_fetch_and_and(&internals->isStopping, 0);  // Cancels a fade out from a callback.
+  else if (isPlaying())
+    fadeOutPlaybackThread(internals);
+  bool warm = internals->settings.warmDevice && internals->hasThread &&
+              !__sync_fetch_and_add(&internals->threadExited, 0);
+  if (!playing) {
+    if (warm) {  // Pause only, the thread and the device stay.
+      __sync_fetch_and_and(&internals->isPlaying, 0);
+      wakeUpPlaybackThread(internals);
+    } else
+      joinPlaybackThread(internals);
+  } else if (!isPlaying() && warm) {
+    __sync_fetch_and_or(&internals->isPlaying, 1);
+    wakeUpPlaybackThread(internals);
+  } else if (!isPlaying() && (internals->wakeupFd >= 0)) {
+    joinPlaybackThread(internals);  // A thread may have stopped by itself.
+    __sync_fetch_and_or(&internals->isPlaying, 1);
+    if (pthread_create(&internals->thread, NULL, playbackThread, internals) == 0)
+      internals->hasThread = true;
+    else {
+      __sync_fetch_and_and(&internals->isPlaying, 0);
+      internals->errorCallback(internals->clientdata, "pthread_create error", 0);
     }
-  } else
-    __sync_fetch_and_and(&internals->isPlaying,
-                         0);  // Notify the audio rendering threads to stop with isPlaying to 0.
+  }
+  pthread_mutex_unlock(&internals->threadMutex);
 }
 
 }  // namespace driver
@@ -111,7 +111,8 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                      NF_RENDER_CALLBACK render_callback,
                                      NF_ERROR_CALLBACK error_callback,
                                      NF_WILL_RENDER_CALLBACK will_render_callback,
-                                     NF_DID_RENDER_CALLBACK did_render_callback) {
+                                     NF_DID_RENDER_CALLBACK did_render_callback,
+                                     const NFSoundCardDriverSettings &settings) {
   // Setting a custom key to the main thread/main queue to properly identify it.
   dispatch_queue_set_specific(dispatch_get_main_queue(), mainQueueKey, (void *)mainQueueKey, NULL);
 
@@ -126,7 +127,8 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                            render_callback,
                                            error_callback,
                                            will_render_callback,
-                                           did_render_callback);
+                                           did_render_callback,
+                                           &settings.adapter);
   recreateAudioUnit(internals);
 
   // Telling Mac OSX that we are okay receiving notifications on any thread.
@@ -348,7 +350,9 @@ static void recreateAudioUnit(NFSoundCardDriverInternals *internals) {
     // Asking for the optimal buffer size. Core Audio can not guarantee it
     // though.
     UInt32 numFrames =
-        (UInt32)NFDriverAdapter::getOptimalNumberOfFrames(static_cast<int>(format.mSampleRate));
+        (UInt32)NFDriverAdapter::getOptimalNumberOfFrames(static_cast<int>(format.mSampleRate),
+                                                          internals->adapter->getBlockFrames(),
+                                                          internals->adapter->isNativeRate());
     address = {kAudioDevicePropertyBufferFrameSize,
                kAudioObjectPropertyScopeGlobal,
                kAudioObjectPropertyElementMaster};
@@ -62,6 +62,7 @@ class streamHandler : public Microsoft::WRL::RuntimeClass<
                 NF_ERROR_CALLBACK error_callback,
                 NF_WILL_RENDER_CALLBACK will_render_callback,
                 NF_DID_RENDER_CALLBACK did_render_callback,
+                const NFDriverAdapterSettings *adapter_settings,
                 DWORD workQueueIdentifier,
                 bool rawProcessingSupported)
       : running(false) {
@@ -79,7 +80,8 @@ class streamHandler : public Microsoft::WRL::RuntimeClass<
                                              render_callback,
                                              error_callback,
                                              will_render_callback,
-                                             did_render_callback);
+                                             did_render_callback,
+                                             adapter_settings);
   }
 
   STDMETHODIMP GetParameters(DWORD *flags, DWORD *queue) {
@@ -236,6 +238,7 @@ typedef struct nativeformat::driver::NFSoundCardDriverInternals {
   NF_STUTTER_CALLBACK stutterCallback;
   NF_ERROR_CALLBACK errorCallback;
   Microsoft::WRL::ComPtr<streamHandler> outputHandler;
+  NFSoundCardDriverSettings settings;
   long isPlaying;
 } NFSoundCardDriverInternals;
 
@@ -244,15 +247,16 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                      NF_RENDER_CALLBACK render_callback,
                                      NF_ERROR_CALLBACK error_callback,
                                      NF_WILL_RENDER_CALLBACK will_render_callback,
-                                     NF_DID_RENDER_CALLBACK did_render_callback) {
-  internals = new NFSoundCardDriverInternals;
-  memset(internals, 0, sizeof(NFSoundCardDriverInternals));
+                                     NF_DID_RENDER_CALLBACK did_render_callback,
+                                     const NFSoundCardDriverSettings &settings) {
+  internals = new NFSoundCardDriverInternals();  // Not memset, the settings hold strings.
   internals->clientdata = clientdata;
   internals->stutterCallback = stutter_callback;
   internals->renderCallback = render_callback;
   internals->willRenderCallback = will_render_callback;
   internals->didRenderCallback = did_render_callback;
   internals->errorCallback = error_callback;
+  internals->settings = settings;
 }
 
 NFSoundCardDriver::~NFSoundCardDriver() {
@@ -302,6 +306,7 @@ static void start(NFSoundCardDriverInternals *internals) {
                                                 internals->errorCallback,
                                                 internals->willRenderCallback,
                                                 internals->didRenderCallback,
+                                                &internals->settings.adapter,
                                                 workQueueId,
                                                 rawProcessingSupported);
         IActivateAudioInterfaceAsyncOperation *asyncOperation;
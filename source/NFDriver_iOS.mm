@@ -219,7 +219,9 @@ static void setSamplerateAndBuffersize(NFSoundCardDriverInternals *internals)
             if ([[AVAudioSession sharedInstance] preferredSampleRate] != internals->outputSamplerate)
                 [[AVAudioSession sharedInstance] setPreferredSampleRate:internals->outputSamplerate error:NULL];
 
-            float numFrames = (float)NFDriverAdapter::getOptimalNumberOfFrames(internals->outputSamplerate);
+            float numFrames = (float)NFDriverAdapter::getOptimalNumberOfFrames(internals->outputSamplerate,
+                                                                               internals->adapter->getBlockFrames(),
+                                                                               internals->adapter->isNativeRate());
             [[AVAudioSession sharedInstance] setPreferredIOBufferDuration:numFrames / float(internals->outputSamplerate)
                                                                     error:NULL];
         }
@@ -373,7 +375,8 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
                                      NF_RENDER_CALLBACK render_callback,
                                      NF_ERROR_CALLBACK error_callback,
                                      NF_WILL_RENDER_CALLBACK will_render_callback,
-                                     NF_DID_RENDER_CALLBACK did_render_callback)
+                                     NF_DID_RENDER_CALLBACK did_render_callback,
+                                     const NFSoundCardDriverSettings &settings)
 {
     // Setting a custom key to the main thread/main queue to properly identify it.
     dispatch_queue_set_specific(dispatch_get_main_queue(), mainQueueKey, (void *)mainQueueKey, NULL);
@@ -386,8 +389,13 @@ NFSoundCardDriver::NFSoundCardDriver(void *clientdata,
     internals->isPlaying = internals->appInBackground = internals->audioUnitRunning = false;
     internals->errorCallback = error_callback;
 
-    internals->adapter = new NFDriverAdapter(
-        clientdata, stutter_callback, render_callback, error_callback, will_render_callback, did_render_callback);
+    internals->adapter = new NFDriverAdapter(clientdata,
+                                             stutter_callback,
+                                             render_callback,
+                                             error_callback,
+                                             will_render_callback,
+                                             did_render_callback,
+                                             &settings.adapter);
     recreateAudioUnit(internals);
 
     // Observing significant app lifecycle events.
@@ -21,9 +21,19 @@
 #include <NFDriver/NFDriver.h>
 
 #define _USE_MATH_DEFINES
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <map>
 #include <string>
+#include <thread>
+#include <vector>
 
 #if __APPLE__
 #include <CoreFoundation/CFRunLoop.h>
@@ -40,27 +50,62 @@
 #define M_PI 3.14159265358979323846
 #endif
 
+// Rendering gives up if no frames came for this long, such as an MP3 driver
+// without LAME.
+#define STALL_TIMEOUT_SECONDS 5
+
+typedef struct sineGenerator {
+  float frequency;
+  unsigned int sinewave;
+  bool printEvents;  // Print every stutter and error, or only count them.
+  std::atomic<long long> framesRendered;
+  std::atomic<int> stutters, xruns, errors;
+
+  // The subcommands: when the render callback reached framesToRender, it sets
+  // finished, after finishTime.
+  long long framesToRender;  // Zero for no limit.
+  std::chrono::steady_clock::time_point finishTime;
+  std::atomic<bool> finished;
+} sineGenerator;
+
 static void stutterCallback(void *clientdata) {
-  printf("stutter\n");
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  generator->stutters++;
+  if (generator->printEvents) printf("stutter\n");
 }
 
 static void errorCallback(void *clientdata, const char *errorMessage, int errorCode) {
-  printf("error %i: %s\n", errorCode, errorMessage);
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  if (strcmp(errorMessage, "virtual device xrun") == 0)
+    generator->xruns++;
+  else
+    generator->errors++;
+  if (generator->printEvents) printf("error %i: %s\n", errorCode, errorMessage);
+}
+
+// Called by the render callbacks after rendering.
+static void countFrames(sineGenerator *generator, int numberOfFrames) {
+  long long framesRendered = generator->framesRendered += numberOfFrames;
+  if (generator->framesToRender && (framesRendered >= generator->framesToRender) &&
+      !generator->finished) {
+    generator->finishTime = std::chrono::steady_clock::now();
+    generator->finished = true;
+  }
 }
 
 static int renderCallback(void *clientdata, float *frames, int numberOfFrames) {
-  const float *samplerate = reinterpret_cast<float *>(clientdata);
-  const float multiplier =
-      (2.0f * static_cast<float>(M_PI) * *samplerate) / static_cast<float>(NF_DRIVER_SAMPLERATE);
-  static unsigned int sinewave = 0;
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  const float multiplier = (2.0f * static_cast<float>(M_PI) * generator->frequency) /
+                           static_cast<float>(NF_DRIVER_SAMPLERATE);
   float audio;
 
   for (int n = 0; n < numberOfFrames; n++) {
-    audio = sinf(multiplier * sinewave++);
+    audio = sinf(multiplier * generator->sinewave++);
     *frames++ = audio;
     *frames++ = audio;
   }
 
+  countFrames(generator, numberOfFrames);
   return numberOfFrames;
 }
 
@@ -68,6 +113,542 @@ static void willRenderCallback(void *clientdata) {}
 
 static void didRenderCallback(void *clientdata) {}
 
+static void resetGenerator(sineGenerator *generator, float frequency, bool printEvents) {
+  generator->frequency = frequency;
+  generator->sinewave = 0;
+  generator->printEvents = printEvents;
+  generator->framesRendered = 0;
+  generator->stutters = generator->xruns = generator->errors = 0;
+  generator->framesToRender = 0;
+  generator->finished = false;
+}
+
+#if !(TARGET_IPHONE_SIMULATOR || TARGET_OS_IPHONE || ANDROID)
+// The headless subcommands. They render as fast as the CPU allows, with the
+// file drivers or the virtual sound card, so they work without audio devices.
+
+static void printUsage() {
+  std::cout << "Usage:" << std::endl
+            << "  ./NFDriverCLI [frequency]" << std::endl
+            << "      Plays a sine wave on the sound card until a key is pressed." << std::endl
+            << "  ./NFDriverCLI render [wav|mp3|aac|virtual] [seconds] [destination] [options]"
+            << std::endl
+            << "      Renders a sine wave as fast as possible, reporting the real-time factor."
+            << std::endl
+            << "  ./NFDriverCLI sweep [seconds] [options]" << std::endl
+            << "      Renders through the adapter at every samplerate and channel count of the"
+            << std::endl
+            << "      virtual sound card." << std::endl
+            << "  ./NFDriverCLI soak [seconds] [options]" << std::endl
+            << "      Renders for long on the virtual sound card, reporting stutters and xruns."
+            << std::endl
+            << "  ./NFDriverCLI verify [budget factor]" << std::endl
+            << "      Checks the output of every driver and its CPU time per frame, for CI."
+            << std::endl
+            << "Options are key=value pairs passed to the driver, such as virtual_jitter_us=5000."
+            << std::endl;
+}
+
+// Adds the key=value arguments starting at argv[first] to the options.
+static bool parseOptions(int argc,
+                         const char *argv[],
+                         int first,
+                         std::map<std::string, std::string> &options) {
+  for (int n = first; n < argc; n++) {
+    const char *separator = strchr(argv[n], '=');
+    if (!separator) {
+      std::cout << "Invalid option, key=value expected: " << argv[n] << std::endl;
+      return false;
+    }
+    options[std::string(argv[n], separator - argv[n])] = separator + 1;
+  }
+  return true;
+}
+
+// Plays until the generator rendered the given seconds of audio. Returns the
+// wall clock seconds it took, or a negative value if the driver couldn't
+// render. The drivers may render a little more before they stop.
+static double renderFor(sineGenerator *generator,
+                        nativeformat::driver::OutputType outputType,
+                        const char *destination,
+                        const std::map<std::string, std::string> &options,
+                        double seconds,
+                        nativeformat::driver::NF_RENDER_CALLBACK render = renderCallback,
+                        nativeformat::driver::NF_PLANAR_RENDER_CALLBACK planarRender = nullptr) {
+  nativeformat::driver::NFDriver *driver =
+      nativeformat::driver::NFDriver::createNFDriver(generator,
+                                                     stutterCallback,
+                                                     render,
+                                                     errorCallback,
+                                                     willRenderCallback,
+                                                     didRenderCallback,
+                                                     outputType,
+                                                     destination,
+                                                     options);
+  if (!driver) return -1.0;
+  if (planarRender && !driver->setPlanarRenderCallback(planarRender)) {
+    delete driver;
+    return -1.0;
+  }
+  generator->framesToRender = static_cast<long long>(seconds * NF_DRIVER_SAMPLERATE);
+  if (generator->framesToRender < 1) generator->framesToRender = 1;
+  auto start = std::chrono::steady_clock::now(), lastProgress = start;
+  long long lastFrames = 0;
+  bool stalled = false;
+
+  driver->setPlaying(true);
+  while (!generator->finished) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto now = std::chrono::steady_clock::now();
+    if (generator->framesRendered != lastFrames) {
+      lastFrames = generator->framesRendered;
+      lastProgress = now;
+    } else if (now - lastProgress > std::chrono::seconds(STALL_TIMEOUT_SECONDS)) {
+      stalled = true;
+      break;
+    }
+  }
+  driver->setPlaying(false);
+  delete driver;
+  if (stalled) return -1.0;
+  return std::chrono::duration<double>(generator->finishTime - start).count();
+}
+
+static bool outputTypeArgument(const std::string &name,
+                               nativeformat::driver::OutputType *outputType) {
+  if (name == "wav")
+    *outputType = nativeformat::driver::OutputTypeFile;
+#if !_WIN32
+  else if (name == "mp3")
+    *outputType = nativeformat::driver::OutputTypeMP3File;
+#endif
+#if __APPLE__
+  else if (name == "aac")
+    *outputType = nativeformat::driver::OutputTypeAACFile;
+#endif
+  else if (name == "virtual")
+    *outputType = nativeformat::driver::OutputTypeVirtualSoundCard;
+  else
+    return false;
+  return true;
+}
+
+static int renderCommand(int argc, const char *argv[]) {
+  nativeformat::driver::OutputType outputType;
+  if ((argc < 4) || !outputTypeArgument(argv[2], &outputType)) {
+    std::cout << "Invalid arguments: ./NFDriverCLI render [wav|mp3|aac|virtual] [seconds] "
+                 "[destination] [options]"
+              << std::endl;
+    return 1;
+  }
+  double seconds = std::stod(argv[3]);
+  // The virtual sound card records its output only if given a destination.
+  int firstOption = 4;
+  const char *destination = nullptr;
+  if ((argc > 4) && !strchr(argv[4], '=')) {
+    destination = argv[4];
+    firstOption = 5;
+  }
+  if (!destination && (outputType != nativeformat::driver::OutputTypeVirtualSoundCard)) {
+    std::cout << "The file drivers need a destination." << std::endl;
+    return 1;
+  }
+  if ((outputType == nativeformat::driver::OutputTypeMP3File) && !getenv("LAME_DYLIB")) {
+    std::cout << "The MP3 driver needs the LAME_DYLIB environment variable." << std::endl;
+    return 1;
+  }
+  std::map<std::string, std::string> options;
+  if (!parseOptions(argc, argv, firstOption, options)) return 1;
+
+  sineGenerator generator;
+  resetGenerator(&generator, 440.0f, false);
+  double elapsed = renderFor(&generator, outputType, destination, options, seconds);
+  if (elapsed < 0.0) {
+    std::cout << "The driver didn't render, " << generator.errors << " errors." << std::endl;
+    return 1;
+  }
+  printf("%.2f s rendered in %.3f s, %.1fx real time, %i stutters, %i xruns, %i errors\n",
+         seconds,
+         elapsed,
+         seconds / elapsed,
+         generator.stutters.load(),
+         generator.xruns.load(),
+         generator.errors.load());
+  return 0;
+}
+
+static int sweepCommand(int argc, const char *argv[]) {
+  static const int samplerates[] = {
+      8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000};
+  static const int channelCounts[] = {1, 2, 4, 6, 8};
+  int firstOption = 2;
+  double seconds = 5.0;
+  if ((argc > 2) && !strchr(argv[2], '=')) {
+    seconds = std::stod(argv[2]);
+    firstOption = 3;
+  }
+  std::map<std::string, std::string> options;
+  if (!parseOptions(argc, argv, firstOption, options)) return 1;
+
+  printf("samplerate channels real-time stutters\n");
+  int failures = 0;
+  for (int samplerate : samplerates) {
+    for (int channels : channelCounts) {
+      options[nativeformat::driver::NF_DRIVER_VIRTUAL_SAMPLERATE_KEY] = std::to_string(samplerate);
+      options[nativeformat::driver::NF_DRIVER_VIRTUAL_CHANNELS_KEY] = std::to_string(channels);
+      sineGenerator generator;
+      resetGenerator(&generator, 440.0f, false);
+      double elapsed = renderFor(&generator,
+                                 nativeformat::driver::OutputTypeVirtualSoundCard,
+                                 nullptr,
+                                 options,
+                                 seconds);
+      if (elapsed < 0.0) {
+        printf("%10i %8i    failed\n", samplerate, channels);
+        failures++;
+        continue;
+      }
+      printf("%10i %8i %8.1fx %8i\n",
+             samplerate,
+             channels,
+             seconds / elapsed,
+             generator.stutters.load());
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+// Fails if there were stutters, so it can run in CI.
+static int soakCommand(int argc, const char *argv[]) {
+  if ((argc < 3) || strchr(argv[2], '=')) {
+    std::cout << "Invalid arguments: ./NFDriverCLI soak [seconds] [options]" << std::endl;
+    return 1;
+  }
+  double seconds = std::stod(argv[2]);
+  std::map<std::string, std::string> options;
+  if (!parseOptions(argc, argv, 3, options)) return 1;
+
+  sineGenerator generator;
+  resetGenerator(&generator, 440.0f, false);
+  double elapsed = renderFor(
+      &generator, nativeformat::driver::OutputTypeVirtualSoundCard, nullptr, options, seconds);
+  if (elapsed < 0.0) {
+    std::cout << "The driver didn't render." << std::endl;
+    return 1;
+  }
+  printf("%.0f s rendered in %.1f s: %i stutters, %i xruns, %i other errors\n",
+         seconds,
+         elapsed,
+         generator.stutters.load(),
+         generator.xruns.load(),
+         generator.errors.load());
+  return generator.stutters ? 1 : 0;
+}
+
+// The golden signal of verify: noise of samples exactly representable in 16
+// bits, different on the left and the right, with every eighth block returned
+// as silence. Integer math only, so it's the same on every platform.
+static float goldenSample(long long frame, int channel) {
+  uint32_t x = static_cast<uint32_t>(frame) * 2u + static_cast<uint32_t>(channel);
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return static_cast<float>(static_cast<int>(x >> 16) - 32768) / 65536.0f;
+}
+
+static bool isGoldenSilence(long long frame, int numberOfFrames) {
+  return ((frame / NF_DRIVER_SAMPLE_BLOCK_SIZE) % 8 == 7) &&
+         (frame / NF_DRIVER_SAMPLE_BLOCK_SIZE ==
+          (frame + numberOfFrames - 1) / NF_DRIVER_SAMPLE_BLOCK_SIZE);
+}
+
+static int goldenRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  const long long frame = generator->framesRendered;
+  const bool silent = isGoldenSilence(frame, numberOfFrames);
+  for (int n = 0; (n < numberOfFrames) && !silent; n++) {
+    *frames++ = goldenSample(frame + n, 0);
+    *frames++ = goldenSample(frame + n, 1);
+  }
+  countFrames(generator, numberOfFrames);
+  return silent ? (numberOfFrames | NF_DRIVER_SILENCE) : numberOfFrames;
+}
+
+static int goldenPlanarRenderCallback(void *clientdata, float **channels, int numberOfFrames) {
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  const long long frame = generator->framesRendered;
+  const bool silent = isGoldenSilence(frame, numberOfFrames);
+  for (int n = 0; (n < numberOfFrames) && !silent; n++) {
+    channels[0][n] = goldenSample(frame + n, 0);
+    channels[1][n] = goldenSample(frame + n, 1);
+  }
+  countFrames(generator, numberOfFrames);
+  return silent ? (numberOfFrames | NF_DRIVER_SILENCE) : numberOfFrames;
+}
+
+// A sine computed in double precision, so the resampler is what limits the
+// signal to noise ratio of the output.
+static int toneRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  sineGenerator *generator = static_cast<sineGenerator *>(clientdata);
+  const double multiplier = 2.0 * M_PI * generator->frequency / NF_DRIVER_SAMPLERATE;
+  const long long frame = generator->framesRendered;
+  for (int n = 0; n < numberOfFrames; n++) {
+    float audio = static_cast<float>(0.5 * sin(multiplier * static_cast<double>(frame + n)));
+    *frames++ = audio;
+    *frames++ = audio;
+  }
+  countFrames(generator, numberOfFrames);
+  return numberOfFrames;
+}
+
+static bool readFile(const char *path, std::vector<unsigned char> *contents) {
+  FILE *fhandle = fopen(path, "rb");
+  if (!fhandle) return false;
+  unsigned char buffer[65536];
+  size_t bytes;
+  while ((bytes = fread(buffer, 1, sizeof(buffer), fhandle)) > 0)
+    contents->insert(contents->end(), buffer, buffer + bytes);
+  fclose(fhandle);
+  return true;
+}
+
+// 64-bit FNV-1a.
+static uint64_t hashBytes(const unsigned char *bytes, size_t numBytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  while (numBytes--) {
+    hash ^= *bytes++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// The signal to noise ratio of a sine in the first channel, in dB, over one
+// second after the resampler settled. Sets the amplitude too.
+static double toneSNR(const float *samples,
+                      int numChannels,
+                      int samplerate,
+                      double frequency,
+                      double *amplitude) {
+  const double omega = 2.0 * M_PI * frequency / samplerate;
+  const float *first = samples + (samplerate / 4) * numChannels;
+  double sinSum = 0.0, cosSum = 0.0;
+  for (int n = 0; n < samplerate; n++) {
+    sinSum += first[n * numChannels] * sin(omega * n);
+    cosSum += first[n * numChannels] * cos(omega * n);
+  }
+  // The window is a whole number of cycles, so sin and cos are orthogonal.
+  const double a = 2.0 * sinSum / samplerate, b = 2.0 * cosSum / samplerate;
+  double noise = 0.0;
+  for (int n = 0; n < samplerate; n++) {
+    double error = first[n * numChannels] - (a * sin(omega * n) + b * cos(omega * n));
+    noise += error * error;
+  }
+  *amplitude = sqrt(a * a + b * b);
+  double signal = *amplitude * *amplitude * 0.5 * samplerate;
+  return 10.0 * log10(signal / (noise > 0.0 ? noise : 1e-30));
+}
+
+typedef enum { verifyGolden, verifyGoldenPlanar, verifyTone, verifyEncoded } verifyCheck;
+
+typedef struct verifyCase {
+  const char *name;
+  nativeformat::driver::OutputType outputType;
+  const char *destination;
+  const char *options;      // key=value pairs separated by spaces.
+  verifyCheck check;
+  uint64_t hash;            // Golden: of the first VERIFY_HASHED_SECONDS of output.
+  double minimumSNR;        // Tone: in dB.
+  double budgetNsPerFrame;  // CPU time per frame rendered, with all threads.
+} verifyCase;
+
+#define VERIFY_SECONDS 3.0
+#define VERIFY_HASHED_SECONDS 2
+#define VERIFY_TONE_FREQUENCY 1000.0f
+
+// Update the hashes only for intended changes of the output. The budgets are
+// for optimized builds, several times what a desktop CPU needs.
+static const verifyCase verifyCases[] = {
+    {"wav16", nativeformat::driver::OutputTypeFile, "verify.wav",
+     "wavsize=16", verifyGolden,
+     0xb02c0afa56bd1d84ULL, 0.0, 60.0},
+    {"wav32", nativeformat::driver::OutputTypeFile, "verify.wav",
+     "wavsize=32", verifyGolden,
+     0x56edd4af2c23ee2cULL, 0.0, 60.0},
+    {"wav32 shared_pool", nativeformat::driver::OutputTypeFile, "verify.wav",
+     "wavsize=32 shared_pool=1", verifyGolden,
+     0x56edd4af2c23ee2cULL, 0.0, 60.0},
+#if !_WIN32
+    {"mp3", nativeformat::driver::OutputTypeMP3File, "verify.mp3",
+     "", verifyEncoded,
+     0ULL, 0.0, 2000.0},
+#endif
+#if __APPLE__
+    {"aac", nativeformat::driver::OutputTypeAACFile, "verify.m4a",
+     "", verifyEncoded,
+     0ULL, 0.0, 2000.0},
+#endif
+    {"virtual 1 channel", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=1", verifyGolden,
+     0x58b62ca901da1c5eULL, 0.0, 60.0},
+    {"virtual 2 channels", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=2", verifyGolden,
+     0xa5c59ea1ce03e198ULL, 0.0, 60.0},
+    {"virtual 2 channels planar", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=2", verifyGoldenPlanar,
+     0xa5c59ea1ce03e198ULL, 0.0, 60.0},
+    {"virtual 4 channels", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=4", verifyGolden,
+     0xaef1074925bb1f38ULL, 0.0, 80.0},
+    {"virtual 6 channels", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=6", verifyGolden,
+     0xe05ed2af2fb3ead8ULL, 0.0, 100.0},
+    {"virtual 8 channels", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=44100 virtual_channels=8", verifyGolden,
+     0xf221e9b1bf194978ULL, 0.0, 120.0},
+    {"virtual 8000 Hz", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=8000", verifyTone,
+     0ULL, 58.0, 120.0},
+    {"virtual 22050 Hz", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=22050", verifyTone,
+     0ULL, 100.0, 150.0},
+    {"virtual 48000 Hz", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=48000", verifyTone,
+     0ULL, 58.0, 150.0},
+    {"virtual 96000 Hz", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=96000", verifyTone,
+     0ULL, 58.0, 180.0},
+    {"virtual 192000 Hz", nativeformat::driver::OutputTypeVirtualSoundCard, "verify.raw",
+     "virtual_samplerate=192000", verifyTone,
+     0ULL, 58.0, 240.0},
+};
+
+// Checks the output of a case. The result tells what's wrong, or the SNR of a
+// tone.
+static bool verifyOutput(const verifyCase &test,
+                         const std::map<std::string, std::string> &options,
+                         char *result,
+                         size_t resultSize) {
+  std::vector<unsigned char> output;
+  result[0] = 0;
+  if (!readFile(test.destination, &output) || output.empty()) {
+    snprintf(result, resultSize, "no output");
+    return false;
+  }
+  if (test.check == verifyEncoded) return true;
+
+  // The audio starts after the WAV header's data chunk, or right away in the
+  // raw floats of the virtual sound card.
+  size_t audio = 0;
+  int numChannels = 2, bytesPerSample = 4, samplerate = NF_DRIVER_SAMPLERATE;
+  if (test.outputType == nativeformat::driver::OutputTypeFile) {
+    for (audio = 12; (audio + 8 <= output.size()) && memcmp(&output[audio], "data", 4);)
+      audio += 8 + (output[audio + 4] | (output[audio + 5] << 8) | (output[audio + 6] << 16) |
+                    (output[audio + 7] << 24));
+    audio += 8;
+    if (options.at(nativeformat::driver::NF_DRIVER_WAV_SIZE_KEY) == "16") bytesPerSample = 2;
+  } else {
+    if (options.count(nativeformat::driver::NF_DRIVER_VIRTUAL_CHANNELS_KEY))
+      numChannels = std::stoi(options.at(nativeformat::driver::NF_DRIVER_VIRTUAL_CHANNELS_KEY));
+    samplerate = std::stoi(options.at(nativeformat::driver::NF_DRIVER_VIRTUAL_SAMPLERATE_KEY));
+  }
+  size_t bytes = static_cast<size_t>(VERIFY_HASHED_SECONDS * samplerate * numChannels) *
+                 static_cast<size_t>(bytesPerSample);
+  if (audio + bytes > output.size()) {
+    snprintf(result, resultSize, "output too short");
+    return false;
+  }
+
+  if (test.check == verifyTone) {
+    double amplitude, snr = toneSNR(reinterpret_cast<const float *>(&output[audio]),
+                                    numChannels,
+                                    samplerate,
+                                    VERIFY_TONE_FREQUENCY,
+                                    &amplitude);
+    snprintf(result,
+             resultSize,
+             "SNR %.1f dB (%.1f dB expected), amplitude %.4f",
+             snr,
+             test.minimumSNR,
+             amplitude);
+    return (snr >= test.minimumSNR) && (fabs(amplitude - 0.5) <= 0.005);
+  }
+  uint64_t hash = hashBytes(&output[audio], bytes);
+  if (hash != test.hash) {
+    snprintf(result,
+             resultSize,
+             "hash 0x%016llxULL, 0x%016llxULL expected",
+             static_cast<unsigned long long>(hash),
+             static_cast<unsigned long long>(test.hash));
+    return false;
+  }
+  return true;
+}
+
+// Fails if an output changed or a case took more CPU time than its budget.
+// The budget factor scales the budgets, for debug or sanitizer builds.
+static int verifyCommand(int argc, const char *argv[]) {
+  double budgetFactor = (argc > 2) ? std::stod(argv[2]) : 1.0;
+  int failures = 0;
+  for (const verifyCase &test : verifyCases) {
+    printf("%-28s", test.name);
+    fflush(stdout);
+    if ((test.check == verifyEncoded) &&
+        (test.outputType == nativeformat::driver::OutputTypeMP3File) && !getenv("LAME_DYLIB")) {
+      printf("skip no LAME_DYLIB\n");
+      continue;
+    }
+    std::map<std::string, std::string> options;
+    std::string optionString = test.options;
+    for (size_t start = 0, end; start < optionString.size(); start = end + 1) {
+      end = optionString.find(' ', start);
+      if (end == std::string::npos) end = optionString.size();
+      size_t separator = optionString.find('=', start);
+      options[optionString.substr(start, separator - start)] =
+          optionString.substr(separator + 1, end - separator - 1);
+    }
+
+    sineGenerator generator;
+    resetGenerator(&generator, VERIFY_TONE_FREQUENCY, false);
+    std::clock_t cpuStart = std::clock();
+    double elapsed =
+        renderFor(&generator,
+                  test.outputType,
+                  test.destination,
+                  options,
+                  VERIFY_SECONDS,
+                  (test.check == verifyTone) ? toneRenderCallback : goldenRenderCallback,
+                  (test.check == verifyGoldenPlanar) ? goldenPlanarRenderCallback : nullptr);
+    double nsPerFrame = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC * 1e9 /
+                        static_cast<double>(generator.framesRendered);
+    bool passed = false;
+    char result[128];
+    if (elapsed < 0.0)
+      printf("FAIL didn't render\n");
+    else if (generator.stutters || generator.xruns || generator.errors)
+      printf("FAIL %i stutters, %i xruns, %i errors\n",
+             generator.stutters.load(),
+             generator.xruns.load(),
+             generator.errors.load());
+    else if (!verifyOutput(test, options, result, sizeof(result)))
+      printf("FAIL %s\n", result);
+    else {
+      passed = nsPerFrame <= test.budgetNsPerFrame * budgetFactor;
+      printf("%s %.1f ns per frame (budget %.1f) %s\n",
+             passed ? "ok  " : "SLOW",
+             nsPerFrame,
+             test.budgetNsPerFrame * budgetFactor,
+             result);
+    }
+    std::remove(test.destination);
+    if (!passed) failures++;
+  }
+  printf("%i failures\n", failures);
+  return failures ? 1 : 0;
+}
+#endif
+
 #ifdef __ANDROID__
 extern "C" JNIEXPORT void JNICALL
 Java_com_spotify_nfdrivertest_1android_MainActivity_nativeMain(JNIEnv *env, jobject self) {
@@ -86,16 +667,22 @@ int main(int argc, const char *argv[]) {
   const std::string samplerate_string = "44100.0";
 #else
   if (argc < 2) {
-    std::cout << "Invalid number of arguments: ./NFDriver [samplerate]" << std::endl;
+    printUsage();
     return 1;
   }
+  const std::string command = argv[1];
+  if (command == "render") return renderCommand(argc, argv);
+  if (command == "sweep") return sweepCommand(argc, argv);
+  if (command == "soak") return soakCommand(argc, argv);
+  if (command == "verify") return verifyCommand(argc, argv);
   const std::string samplerate_string = argv[1];
 #endif
 
-  float samplerate = std::stof(samplerate_string);
+  sineGenerator generator;
+  resetGenerator(&generator, std::stof(samplerate_string), true);
 
   nativeformat::driver::NFDriver *driver =
-      nativeformat::driver::NFDriver::createNFDriver(&samplerate,
+      nativeformat::driver::NFDriver::createNFDriver(&generator,
                                                      stutterCallback,
                                                      renderCallback,
                                                      errorCallback,
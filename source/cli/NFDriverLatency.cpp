@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+// Measures the round-trip latency of the sound card: plays clicks and finds
+// them in the input captured in the same thread, on the same clock. Connect the
+// output to the input with a cable, or use the ALSA loopback device:
+//
+//   modprobe snd-aloop
+//   ./NFDriverLatency hw:Loopback,0,0 hw:Loopback,1,0
+//
+// The latency is from rendering a frame to receiving it in the input callback,
+// so it includes the output buffer, the capture period and the path between.
+
+#define NUMBER_OF_CLICKS 10
+#define CLICK_INTERVAL_SECONDS 0.5
+#define CLICK_THRESHOLD 0.5f
+#define TIMEOUT_SECONDS 20
+
+typedef struct latencyMeasurement {
+  std::atomic<int> samplerate, clicksMeasured;
+  long long latencyFrames[NUMBER_OF_CLICKS];
+  // Audio thread only. Both count frames from the start of playback.
+  long long framesRendered, framesCaptured, clickFrame, nextClickFrame;
+} latencyMeasurement;
+
+static void stutterCallback(void *clientdata) {
+  printf("stutter\n");
+}
+
+static void errorCallback(void *clientdata, const char *errorMessage, int errorCode) {
+  printf("error %i: %s\n", errorCode, errorMessage);
+}
+
+static void samplerateCallback(void *clientdata, int samplerate) {
+  static_cast<latencyMeasurement *>(clientdata)->samplerate = samplerate;
+}
+
+// A single full scale frame every CLICK_INTERVAL_SECONDS, silence otherwise.
+static int renderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  latencyMeasurement *measurement = static_cast<latencyMeasurement *>(clientdata);
+  for (int n = 0; n < numberOfFrames; n++) {
+    long long frame = measurement->framesRendered + n;
+    float audio = 0.0f;
+    if ((frame == measurement->nextClickFrame) &&
+        (measurement->clicksMeasured < NUMBER_OF_CLICKS)) {
+      audio = 1.0f;
+      measurement->clickFrame = frame;
+      measurement->nextClickFrame +=
+          static_cast<long long>(CLICK_INTERVAL_SECONDS * measurement->samplerate);
+    }
+    *frames++ = audio;
+    *frames++ = audio;
+  }
+  measurement->framesRendered += numberOfFrames;
+  return numberOfFrames;
+}
+
+static void inputCallback(void *clientdata, const float *frames, int numberOfFrames) {
+  latencyMeasurement *measurement = static_cast<latencyMeasurement *>(clientdata);
+  for (int n = 0; (n < numberOfFrames) && (measurement->clickFrame >= 0); n++) {
+    if ((fabsf(frames[n * 2]) < CLICK_THRESHOLD) && (fabsf(frames[n * 2 + 1]) < CLICK_THRESHOLD))
+      continue;
+    int click = measurement->clicksMeasured;
+    measurement->latencyFrames[click] =
+        measurement->framesCaptured + n - measurement->clickFrame;
+    measurement->clickFrame = -1;
+    measurement->clicksMeasured = click + 1;
+  }
+  measurement->framesCaptured += numberOfFrames;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 2) {
+    std::cout << "Invalid number of arguments: ./NFDriverLatency [output device] [input device]"
+              << std::endl;
+    return 1;
+  }
+
+  latencyMeasurement measurement;
+  measurement.samplerate = NF_DRIVER_SAMPLERATE;
+  measurement.clicksMeasured = 0;
+  measurement.framesRendered = measurement.framesCaptured = 0;
+  measurement.clickFrame = -1;
+  measurement.nextClickFrame =
+      static_cast<long long>(CLICK_INTERVAL_SECONDS * NF_DRIVER_SAMPLERATE);
+
+  // Rendering at the sound card's samplerate, exactly as many frames as the
+  // sound card takes, so a rendered frame's index is its index on the output.
+  std::map<std::string, std::string> options;
+  options[nativeformat::driver::NF_DRIVER_NATIVE_RATE_KEY] = "1";
+  options[nativeformat::driver::NF_DRIVER_DIRECT_KEY] = "1";
+  if (argc > 2) options[nativeformat::driver::NF_DRIVER_CAPTURE_DEVICE_KEY] = argv[2];
+
+  nativeformat::driver::NFDriver *driver =
+      nativeformat::driver::NFDriver::createNFDriver(&measurement,
+                                                     stutterCallback,
+                                                     renderCallback,
+                                                     errorCallback,
+                                                     nullptr,
+                                                     nullptr,
+                                                     nativeformat::driver::OutputTypeSoundCard,
+                                                     argv[1],
+                                                     options);
+  driver->setSamplerateCallback(samplerateCallback);
+  if (!driver->setInputCallback(inputCallback)) {
+    std::cout << "The sound card driver can't capture on this platform." << std::endl;
+    delete driver;
+    return 1;
+  }
+  driver->setPlaying(true);
+
+  auto start = std::chrono::steady_clock::now();
+  while ((measurement.clicksMeasured < NUMBER_OF_CLICKS) &&
+         (std::chrono::steady_clock::now() - start < std::chrono::seconds(TIMEOUT_SECONDS)))
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  driver->setPlaying(false);
+
+  int clicks = measurement.clicksMeasured;
+  if (!clicks) {
+    std::cout << "No clicks came back. Is the output connected to the input?" << std::endl;
+    delete driver;
+    return 1;
+  }
+  long long minimum = measurement.latencyFrames[0], maximum = minimum, sum = 0;
+  for (int n = 0; n < clicks; n++) {
+    long long latency = measurement.latencyFrames[n];
+    if (latency < minimum) minimum = latency;
+    if (latency > maximum) maximum = latency;
+    sum += latency;
+  }
+  double msPerFrame = 1000.0 / measurement.samplerate;
+  printf("%i clicks at %i Hz, round-trip latency: %lld frames (%.2f ms) average, %lld min, "
+         "%lld max\n",
+         clicks,
+         measurement.samplerate.load(),
+         sum / clicks,
+         (sum / clicks) * msPerFrame,
+         minimum,
+         maximum);
+  delete driver;
+  return 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NFDriverAdapter.h"
+
+// Deterministic tests of the adapter and the virtual sound card: the render
+// callback cadence and frame counts at small block sizes, and the resampler's
+// state across blocks. Returns the number of failures.
+
+using nativeformat::driver::NFDriver;
+using nativeformat::driver::NFDriverAdapter;
+using nativeformat::driver::NFDriverAdapterSettings;
+using nativeformat::driver::NFDriverTimestamp;
+
+static int failures = 0;
+
+#define EXPECT(condition, ...)                       \
+  do {                                               \
+    if (!(condition)) {                              \
+      printf("FAIL %s:%i: ", __FILE__, __LINE__);    \
+      printf(__VA_ARGS__);                           \
+      printf("\n");                                  \
+      failures++;                                    \
+    }                                                \
+  } while (0)
+
+// The source renders a sawtooth of ramps, so every output frame can be checked
+// against the exact linear interpolation at its position.
+#define RAMP_FRAMES 4096
+
+static double rampSample(long long frame) {
+  return (frame < 0) ? 0.0 : static_cast<double>(frame % RAMP_FRAMES) / RAMP_FRAMES;
+}
+
+typedef struct rampSource {
+  long long framesRendered;
+  int renderCalls, stutters, wrongSizes, blockFrames;
+} rampSource;
+
+static int rampRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  rampSource *source = static_cast<rampSource *>(clientdata);
+  if (numberOfFrames != source->blockFrames) source->wrongSizes++;
+  for (int n = 0; n < numberOfFrames; n++) {
+    float sample = static_cast<float>(rampSample(source->framesRendered++));
+    *frames++ = sample;
+    *frames++ = -sample;
+  }
+  source->renderCalls++;
+  return numberOfFrames;
+}
+
+static void rampStutterCallback(void *clientdata) {
+  static_cast<rampSource *>(clientdata)->stutters++;
+}
+
+static void errorCallback(void *clientdata, const char *errorMessage, int errorCode) {
+  printf("error %i: %s\n", errorCode, errorMessage);
+  failures++;
+}
+
+static NFDriverAdapterSettings blockSettings(int blockFrames) {
+  NFDriverAdapterSettings settings = NFDriverAdapterSettings();
+  settings.blockFrames = blockFrames;
+  settings.gainRampMs = 10.0f;
+  return settings;
+}
+
+// At 44100 Hz the period is the block: every period renders exactly one block,
+// straight through.
+static void testBlockCadenceWithoutResampling(int blockFrames) {
+  int periodFrames = NFDriverAdapter::getOptimalNumberOfFrames(NF_DRIVER_SAMPLERATE, blockFrames);
+  EXPECT(periodFrames == blockFrames, "%i frame blocks: period %i", blockFrames, periodFrames);
+
+  rampSource source = rampSource();
+  source.blockFrames = blockFrames;
+  NFDriverAdapterSettings settings = blockSettings(blockFrames);
+  NFDriverAdapter adapter(
+      &source, rampStutterCallback, rampRenderCallback, errorCallback, NULL, NULL, &settings);
+  EXPECT(adapter.getBlockFrames() == blockFrames, "%i frame blocks", blockFrames);
+  adapter.setSamplerate(NF_DRIVER_SAMPLERATE);
+
+  std::vector<float> output(static_cast<size_t>(periodFrames) * 2);
+  long long framesOutput = 0;
+  for (int period = 0; period < 10000; period++) {
+    int renderCalls = source.renderCalls;
+    EXPECT(adapter.getFrames(output.data(), NULL, periodFrames, 2),
+           "%i frame blocks: period %i failed",
+           blockFrames,
+           period);
+    EXPECT(source.renderCalls - renderCalls == 1,
+           "%i frame blocks: %i renders in period %i",
+           blockFrames,
+           source.renderCalls - renderCalls,
+           period);
+    for (int n = 0; n < periodFrames; n++, framesOutput++) {
+      if (output[n * 2] != static_cast<float>(rampSample(framesOutput))) {
+        EXPECT(false, "%i frame blocks: frame %lld is wrong", blockFrames, framesOutput);
+        return;
+      }
+    }
+  }
+  EXPECT(source.framesRendered == framesOutput,
+         "%i frame blocks: %lld frames rendered for %lld",
+         blockFrames,
+         source.framesRendered,
+         framesOutput);
+  EXPECT(source.stutters == 0, "%i frame blocks: %i stutters", blockFrames, source.stutters);
+  EXPECT(source.wrongSizes == 0, "%i frame blocks: %i wrong sizes", blockFrames, source.wrongSizes);
+}
+
+// At 48000 Hz a period needs 147/160 of a block. The render callback still
+// gets whole blocks, at most one per period, and only as many as the output
+// needs: the buffer never holds more than a block. Output frame n is at input
+// position n * 44100 / samplerate - 1, the resampler starting from silence.
+static void testBlockCadenceWithResampling(int blockFrames, int samplerate) {
+  int periodFrames = NFDriverAdapter::getOptimalNumberOfFrames(samplerate, blockFrames);
+  int expectedPeriodFrames = blockFrames * samplerate / NF_DRIVER_SAMPLERATE;
+  EXPECT(periodFrames == expectedPeriodFrames,
+         "%i frame blocks at %i Hz: period %i",
+         blockFrames,
+         samplerate,
+         periodFrames);
+
+  rampSource source = rampSource();
+  source.blockFrames = blockFrames;
+  NFDriverAdapterSettings settings = blockSettings(blockFrames);
+  NFDriverAdapter adapter(
+      &source, rampStutterCallback, rampRenderCallback, errorCallback, NULL, NULL, &settings);
+  adapter.setSamplerate(samplerate);
+
+  const double ratio = static_cast<double>(NF_DRIVER_SAMPLERATE) / samplerate;
+  std::vector<float> output(static_cast<size_t>(periodFrames) * 2);
+  long long framesOutput = 0;
+  // A minute of output, so the rational phase wraps many times.
+  int numPeriods = samplerate * 60 / periodFrames;
+  for (int period = 0; period < numPeriods; period++) {
+    int renderCalls = source.renderCalls;
+    EXPECT(adapter.getFrames(output.data(), NULL, periodFrames, 2),
+           "%i frame blocks at %i Hz: period %i failed",
+           blockFrames,
+           samplerate,
+           period);
+    EXPECT(source.renderCalls - renderCalls <= 1,
+           "%i frame blocks at %i Hz: %i renders in period %i",
+           blockFrames,
+           samplerate,
+           source.renderCalls - renderCalls,
+           period);
+    framesOutput += periodFrames;
+
+    // Enough input for the output so far, and less than a block more.
+    double inputNeeded = framesOutput * ratio - 1.0;
+    EXPECT((source.framesRendered >= inputNeeded) &&
+               (source.framesRendered < inputNeeded + blockFrames + 2),
+           "%i frame blocks at %i Hz: %lld frames rendered for %lld",
+           blockFrames,
+           samplerate,
+           source.framesRendered,
+           framesOutput);
+
+    // The resampler carries its exact position and the previous frame across
+    // blocks, so every frame is where it should be, also at block edges.
+    for (int n = 0; n < periodFrames; n++) {
+      long long frame = framesOutput - periodFrames + n;
+      long long position = frame * NF_DRIVER_SAMPLERATE - samplerate;
+      long long index = (position >= 0) ? position / samplerate : -1;
+      double weight = static_cast<double>(position - index * samplerate) / samplerate;
+      double expected = rampSample(index) * (1.0 - weight) + rampSample(index + 1) * weight;
+      if (fabs(output[n * 2] - expected) > 1e-5) {
+        EXPECT(false,
+               "%i frame blocks at %i Hz: frame %lld is %f instead of %f",
+               blockFrames,
+               samplerate,
+               frame,
+               output[n * 2],
+               expected);
+        return;
+      }
+    }
+  }
+  EXPECT(source.stutters == 0,
+         "%i frame blocks at %i Hz: %i stutters",
+         blockFrames,
+         samplerate,
+         source.stutters);
+  EXPECT(source.wrongSizes == 0,
+         "%i frame blocks at %i Hz: %i wrong sizes",
+         blockFrames,
+         samplerate,
+         source.wrongSizes);
+}
+
+// Through the virtual sound card, where the period follows block_size: every
+// render callback gets one block, and the will render timestamps advance by
+// exactly one period on the virtual clock.
+#define VIRTUAL_PERIODS 2000
+
+typedef struct virtualRecorder {
+  int blockFrames;
+  std::atomic<int> renderCalls, wrongSizes, stutters, timestamps;
+  long long framesRendered[VIRTUAL_PERIODS];
+  double times[VIRTUAL_PERIODS];
+} virtualRecorder;
+
+static int virtualRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  virtualRecorder *recorder = static_cast<virtualRecorder *>(clientdata);
+  if (numberOfFrames != recorder->blockFrames) recorder->wrongSizes++;
+  memset(frames, 0, static_cast<size_t>(numberOfFrames) * NF_DRIVER_CHANNELS * sizeof(float));
+  recorder->renderCalls++;
+  return numberOfFrames;
+}
+
+static void virtualStutterCallback(void *clientdata) {
+  static_cast<virtualRecorder *>(clientdata)->stutters++;
+}
+
+static void virtualTimestampCallback(void *clientdata, const NFDriverTimestamp *timestamp) {
+  virtualRecorder *recorder = static_cast<virtualRecorder *>(clientdata);
+  int index = recorder->timestamps;
+  if (index >= VIRTUAL_PERIODS) return;
+  recorder->framesRendered[index] = timestamp->framesRendered;
+  recorder->times[index] = timestamp->timestamp;
+  recorder->timestamps = index + 1;
+}
+
+static void willRenderCallback(void *clientdata) {}
+static void didRenderCallback(void *clientdata) {}
+
+static void testVirtualDeviceCadence(int blockFrames) {
+  virtualRecorder *recorder = new virtualRecorder();
+  recorder->blockFrames = blockFrames;
+  recorder->renderCalls = recorder->wrongSizes = recorder->stutters = recorder->timestamps = 0;
+  std::map<std::string, std::string> options;
+  options[nativeformat::driver::NF_DRIVER_BLOCK_SIZE_KEY] = std::to_string(blockFrames);
+  options[nativeformat::driver::NF_DRIVER_VIRTUAL_SAMPLERATE_KEY] =
+      std::to_string(NF_DRIVER_SAMPLERATE);
+  NFDriver *driver = NFDriver::createNFDriver(recorder,
+                                              virtualStutterCallback,
+                                              virtualRenderCallback,
+                                              errorCallback,
+                                              willRenderCallback,
+                                              didRenderCallback,
+                                              nativeformat::driver::OutputTypeVirtualSoundCard,
+                                              nullptr,
+                                              options);
+  driver->setWillRenderTimestampCallback(virtualTimestampCallback);
+  driver->setPlaying(true);
+  auto start = std::chrono::steady_clock::now();
+  while ((recorder->timestamps < VIRTUAL_PERIODS) &&
+         (std::chrono::steady_clock::now() - start < std::chrono::seconds(10)))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  driver->setPlaying(false);
+  delete driver;
+
+  EXPECT(recorder->timestamps == VIRTUAL_PERIODS,
+         "%i frame blocks: %i periods",
+         blockFrames,
+         recorder->timestamps.load());
+  const double periodSeconds = static_cast<double>(blockFrames) / NF_DRIVER_SAMPLERATE;
+  for (int n = 0; n < recorder->timestamps; n++) {
+    if ((recorder->framesRendered[n] != static_cast<long long>(n) * blockFrames) ||
+        (fabs(recorder->times[n] - n * periodSeconds) > 1e-9)) {
+      EXPECT(false,
+             "%i frame blocks: period %i at frame %lld, %f s",
+             blockFrames,
+             n,
+             recorder->framesRendered[n],
+             recorder->times[n]);
+      break;
+    }
+  }
+  // The callbacks of the periods after the last one recorded count too.
+  EXPECT(recorder->renderCalls >= VIRTUAL_PERIODS,
+         "%i frame blocks: %i renders",
+         blockFrames,
+         recorder->renderCalls.load());
+  EXPECT(recorder->wrongSizes == 0,
+         "%i frame blocks: %i wrong sizes",
+         blockFrames,
+         recorder->wrongSizes.load());
+  EXPECT(recorder->stutters == 0,
+         "%i frame blocks: %i stutters",
+         blockFrames,
+         recorder->stutters.load());
+  delete recorder;
+}
+
+static int constantRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  for (int n = 0; n < numberOfFrames * 2; n++) frames[n] = 0.5f;
+  return numberOfFrames;
+}
+
+// Checks one period of a linear gain ramp over 441 frames, 10 ms.
+static bool expectRamp(const float *output, int periodFrames, int frame, float from, float to) {
+  for (int n = 0; n < periodFrames; n++, frame++) {
+    float progress = (frame < 441) ? static_cast<float>(frame) / 441.0f : 1.0f;
+    float expected = 0.5f * (from + (to - from) * progress);
+    if (fabsf(output[n * 2] - expected) > 0.0001f) {
+      EXPECT(false, "fade frame %i is %f instead of %f", frame, output[n * 2], expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Starting ramps the gain up from 0, and stopping ramps it down to 0 again,
+// both over gain_ramp_ms.
+static void testFades() {
+  rampSource source = rampSource();
+  NFDriverAdapterSettings settings = blockSettings(NF_DRIVER_SAMPLE_BLOCK_SIZE);
+  NFDriverAdapter adapter(
+      &source, rampStutterCallback, constantRenderCallback, errorCallback, NULL, NULL, &settings);
+  adapter.setSamplerate(NF_DRIVER_SAMPLERATE);
+  adapter.fadeIn();
+
+  const int periodFrames = 147;
+  std::vector<float> output(static_cast<size_t>(periodFrames) * 2);
+  for (int frame = 0; frame < 882; frame += periodFrames) {
+    EXPECT(adapter.getFrames(output.data(), NULL, periodFrames, 2), "fade in failed");
+    if (!expectRamp(output.data(), periodFrames, frame, 0.0f, 1.0f)) return;
+  }
+  EXPECT(adapter.getGain() == 1.0f, "gain %f after the fade in", adapter.getGain());
+
+  adapter.setGain(0.0f);
+  for (int frame = 0; frame < 882; frame += periodFrames) {
+    EXPECT(adapter.getFrames(output.data(), NULL, periodFrames, 2), "fade out failed");
+    if (!expectRamp(output.data(), periodFrames, frame, 1.0f, 0.0f)) return;
+  }
+  EXPECT(adapter.getGain() == 0.0f, "gain %f after the fade out", adapter.getGain());
+  EXPECT(source.stutters == 0, "%i stutters while fading", source.stutters);
+}
+
+int main(int argc, const char *argv[]) {
+  const int blockSizes[] = {64, 128, 256};
+  for (int blockFrames : blockSizes) {
+    testBlockCadenceWithoutResampling(blockFrames);
+    testBlockCadenceWithResampling(blockFrames, 48000);
+    testBlockCadenceWithResampling(blockFrames, 96000);
+    testVirtualDeviceCadence(blockFrames);
+  }
+  testFades();
+  printf("%i failures\n", failures);
+  return failures ? 1 : 0;
+}
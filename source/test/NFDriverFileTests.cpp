@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#include <NFDriver/NFDriver.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
+
+// Tests of the file drivers' threads: a render callback without frames is
+// retried with a backoff, on a thread of the driver's own and on the shared
+// pool. Returns the number of failures. The MP3 driver needs LAME_DYLIB.
+
+using nativeformat::driver::NFDriver;
+using nativeformat::driver::OutputType;
+
+static int failures = 0;
+
+#define EXPECT(condition, ...)                       \
+  do {                                               \
+    if (!(condition)) {                              \
+      printf("FAIL %s:%i: ", __FILE__, __LINE__);    \
+      printf(__VA_ARGS__);                           \
+      printf("\n");                                  \
+      failures++;                                    \
+    }                                                \
+  } while (0)
+
+// Retries after 1, 2, 4, 8 and then every 16 ms: about 25 renders in the
+// test's time. Without the backoff it's a busy loop of many thousands.
+#define STARVED_MS 320
+#define MAX_STARVED_RENDERS 64
+
+static std::atomic<int> renders;
+
+static int starvedRenderCallback(void *clientdata, float *frames, int numberOfFrames) {
+  renders++;
+  return 0;
+}
+
+static void stutterCallback(void *clientdata) {}
+
+static void errorCallback(void *clientdata, const char *errorMessage, int errorCode) {
+  printf("error %i: %s\n", errorCode, errorMessage);
+  failures++;
+}
+
+static void testStarvedRenderBacksOff(const char *name,
+                                      OutputType outputType,
+                                      const char *destination,
+                                      bool sharedPool) {
+  // retry_min_ms is left at its default, which must back off too.
+  std::map<std::string, std::string> options;
+  options[nativeformat::driver::NF_DRIVER_RETRY_MAX_MS_KEY] = "16";
+  options[nativeformat::driver::NF_DRIVER_SHARED_POOL_KEY] = sharedPool ? "1" : "0";
+  renders = 0;
+  NFDriver *driver = NFDriver::createNFDriver(nullptr,
+                                              stutterCallback,
+                                              starvedRenderCallback,
+                                              errorCallback,
+                                              nullptr,
+                                              nullptr,
+                                              outputType,
+                                              destination,
+                                              options);
+  driver->setPlaying(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(STARVED_MS));
+  driver->setPlaying(false);
+  delete driver;
+  std::remove(destination);
+
+  EXPECT((renders > 1) && (renders <= MAX_STARVED_RENDERS),
+         "%s%s: %i starved renders in %i ms",
+         name,
+         sharedPool ? " shared_pool" : "",
+         renders.load(),
+         STARVED_MS);
+}
+
+int main(int argc, const char *argv[]) {
+  const bool sharedPool[] = {false, true};
+  for (bool shared : sharedPool) {
+    testStarvedRenderBacksOff(
+        "wav", nativeformat::driver::OutputTypeFile, "NFDriverFileTests.wav", shared);
+#if !_WIN32
+    if (getenv("LAME_DYLIB"))
+      testStarvedRenderBacksOff(
+          "mp3", nativeformat::driver::OutputTypeMP3File, "NFDriverFileTests.mp3", shared);
+    else
+      printf("mp3 skipped, no LAME_DYLIB\n");
+#endif
+  }
+  printf("%i failures\n", failures);
+  return failures ? 1 : 0;
+}